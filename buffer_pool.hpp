@@ -0,0 +1,262 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z1F7B3C58_92D4_4E1A_A6F0_3D8E52C9B714)
+#define Z1F7B3C58_92D4_4E1A_A6F0_3D8E52C9B714
+
+#include <boost/config.hpp>
+
+#include <vector>
+#include <mutex>
+#include <new>
+#include <cstddef>
+
+// See buffer_pool::stats().
+struct buffer_pool_stats
+{
+    std::size_t hits;         ///< Allocations served from a free list.
+    std::size_t misses;       ///< Allocations that went to operator new.
+    std::size_t releases;     ///< Blocks handed back to the pool.
+    std::size_t cached_bytes; ///< Bytes sitting in the free lists.
+
+    buffer_pool_stats()
+      : hits(0)
+      , misses(0)
+      , releases(0)
+      , cached_bytes(0)
+    {}
+};
+
+// Recycles the storage of received vectors. Parcels are typically created by
+// the receiver, consumed and dropped, so every large chunk would otherwise be
+// a fresh malloc (and, for large chunks, fresh pages to fault in). Blocks are
+// kept in free lists by size class; a block that is released goes back to its
+// list, and the next allocation of that class gets it back with its pages
+// already mapped. Up to fine_class_threshold the classes are powers of two;
+// above it, every power of two is split into fine_classes_per_octave
+// classes, so that a large block is never more than a quarter larger than
+// what was asked for.
+struct buffer_pool
+{
+    BOOST_STATIC_CONSTANT(std::size_t, min_class_size = 64);
+    BOOST_STATIC_CONSTANT(std::size_t, fine_class_threshold
+                                     = std::size_t(64) << 10);
+    BOOST_STATIC_CONSTANT(std::size_t, fine_classes_per_octave = 4);
+    BOOST_STATIC_CONSTANT(std::size_t, coarse_classes = 11); ///< Up to, and
+        ///< including, fine_class_threshold.
+    BOOST_STATIC_CONSTANT(std::size_t, size_classes
+        = coarse_classes
+        + fine_classes_per_octave * (sizeof(std::size_t) * 8 - 18));
+    BOOST_STATIC_CONSTANT(std::size_t, default_max_cached_bytes
+                                     = std::size_t(256) << 20);
+
+  private:
+    mutable std::mutex mutex_;
+    std::vector<std::vector<void*> > free_lists_; ///< One per size class.
+    std::size_t max_cached_bytes_;
+    buffer_pool_stats stats_;
+
+  public:
+    explicit buffer_pool(
+        std::size_t max_cached_bytes = default_max_cached_bytes
+        )
+      : mutex_()
+      , free_lists_(size_classes)
+      , max_cached_bytes_(max_cached_bytes)
+      , stats_()
+    {}
+
+    ~buffer_pool()
+    {
+        trim();
+    }
+
+    // The pool used by pool_allocator unless it is given another one.
+    static buffer_pool& instance()
+    {
+        static buffer_pool pool;
+        return pool;
+    }
+
+    // The size class of a block of the given size: the smallest class that
+    // holds it.
+    static std::size_t size_class(std::size_t bytes)
+    {
+        if (bytes <= fine_class_threshold)
+        {
+            std::size_t c = 0;
+            while ((min_class_size << c) < bytes)
+                ++c;
+            return c;
+        }
+
+        // The octave above fine_class_threshold that bytes falls into, and
+        // which of its steps holds it.
+        std::size_t octave = 0;
+        while ((fine_class_threshold << (octave + 1)) < bytes)
+            ++octave;
+
+        std::size_t const base = fine_class_threshold << octave;
+        std::size_t const step = base / fine_classes_per_octave;
+
+        return coarse_classes + octave * fine_classes_per_octave
+             + (bytes - base - 1) / step;
+    }
+
+    static std::size_t class_size(std::size_t c)
+    {
+        if (c < coarse_classes)
+            return min_class_size << c;
+
+        std::size_t const octave = (c - coarse_classes)
+                                 / fine_classes_per_octave;
+        std::size_t const steps = (c - coarse_classes)
+                                % fine_classes_per_octave + 1;
+
+        std::size_t const base = fine_class_threshold << octave;
+        return base + steps * (base / fine_classes_per_octave);
+    }
+
+    void* allocate(std::size_t bytes)
+    {
+        if (bytes > class_size(size_classes - 1))
+            throw std::bad_alloc();
+
+        std::size_t const c = size_class(bytes);
+
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+
+            std::vector<void*>& free_list = free_lists_.at(c);
+
+            if (!free_list.empty())
+            {
+                void* p = free_list.back();
+                free_list.pop_back();
+
+                ++stats_.hits;
+                stats_.cached_bytes -= class_size(c);
+                return p;
+            }
+
+            ++stats_.misses;
+        }
+
+        return ::operator new(class_size(c));
+    }
+
+    // Give back a block from allocate(bytes). It is cached unless that would
+    // take the pool over its limit.
+    void deallocate(void* p, std::size_t bytes)
+    {
+        if (0 == p)
+            return;
+
+        std::size_t const c = size_class(bytes);
+
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+
+            ++stats_.releases;
+
+            if (stats_.cached_bytes + class_size(c) <= max_cached_bytes_)
+            {
+                free_lists_.at(c).push_back(p);
+                stats_.cached_bytes += class_size(c);
+                return;
+            }
+        }
+
+        ::operator delete(p);
+    }
+
+    // Free all cached blocks.
+    void trim()
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+
+        for (std::size_t c = 0; c < free_lists_.size(); ++c)
+        {
+            for (std::size_t i = 0; i < free_lists_[c].size(); ++i)
+                ::operator delete(free_lists_[c][i]);
+            free_lists_[c].clear();
+        }
+
+        stats_.cached_bytes = 0;
+    }
+
+    std::size_t max_cached_bytes() const
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        return max_cached_bytes_;
+    }
+
+    void max_cached_bytes(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        max_cached_bytes_ = bytes;
+    }
+
+    buffer_pool_stats stats() const
+    {
+        std::lock_guard<std::mutex> l(mutex_);
+        return stats_;
+    }
+};
+
+// A std::allocator replacement that takes its storage from a buffer_pool, for
+// received vectors: std::vector<double, pool_allocator<double> >. It combines
+// with default_init_allocator, which goes on the outside.
+template <typename T>
+struct pool_allocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef pool_allocator<U> other;
+    };
+
+    buffer_pool* pool;
+
+    pool_allocator()
+      : pool(&buffer_pool::instance())
+    {}
+
+    explicit pool_allocator(buffer_pool& p)
+      : pool(&p)
+    {}
+
+    template <typename U>
+    pool_allocator(pool_allocator<U> const& a)
+      : pool(a.pool)
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        return static_cast<T*>(pool->allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        pool->deallocate(p, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(pool_allocator<T> const& a, pool_allocator<U> const& b)
+{
+    return a.pool == b.pool;
+}
+
+template <typename T, typename U>
+bool operator!=(pool_allocator<T> const& a, pool_allocator<U> const& b)
+{
+    return a.pool != b.pool;
+}
+
+#endif
+
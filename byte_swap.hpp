@@ -0,0 +1,151 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z2E8F4B71_6D0A_4C93_B5E2_184C7A3D9F06)
+#define Z2E8F4B71_6D0A_4C93_B5E2_184C7A3D9F06
+
+#include <boost/cstdint.hpp>
+
+#include <cstring>
+#include <cstddef>
+
+#if defined(__SSSE3__)
+    #include <tmmintrin.h>
+#endif
+
+// Bulk byte swapping of arrays of fundamental types, used for peers of the
+// opposite endianness. Elements of 2, 4 and 8 bytes are swapped 16 bytes at a
+// time with a byte shuffle when SSSE3 is available (make NATIVE=1); otherwise
+// we fall back to a scalar loop that the compiler can still unroll.
+
+namespace detail
+{
+    inline boost::uint16_t bswap(boost::uint16_t x)
+    {
+        return boost::uint16_t((x >> 8) | (x << 8));
+    }
+
+    inline boost::uint32_t bswap(boost::uint32_t x)
+    {
+        return __builtin_bswap32(x);
+    }
+
+    inline boost::uint64_t bswap(boost::uint64_t x)
+    {
+        return __builtin_bswap64(x);
+    }
+
+    template <std::size_t Size>
+    struct swap_word;
+
+    template <> struct swap_word<2> { typedef boost::uint16_t type; };
+    template <> struct swap_word<4> { typedef boost::uint32_t type; };
+    template <> struct swap_word<8> { typedef boost::uint64_t type; };
+
+    // Swap n elements of Size bytes from src to dst; src == dst is fine.
+    template <std::size_t Size>
+    void byte_swap_words(char const* src, char* dst, std::size_t n)
+    {
+        typedef typename swap_word<Size>::type word;
+
+        std::size_t i = 0;
+
+#if defined(__SSSE3__)
+        static char const masks[3][16] = {
+            { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 }
+          , { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 }
+          , { 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 }
+        };
+
+        __m128i const mask = _mm_loadu_si128(reinterpret_cast<__m128i const*>(
+            masks[(Size == 2) ? 0 : ((Size == 4) ? 1 : 2)]));
+
+        std::size_t const per_vector = 16 / Size;
+
+        for (; i + per_vector <= n; i += per_vector)
+        {
+            __m128i v = _mm_loadu_si128(
+                reinterpret_cast<__m128i const*>(src + i * Size));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * Size)
+                           , _mm_shuffle_epi8(v, mask));
+        }
+#endif
+
+        for (; i < n; ++i)
+        {
+            word w;
+            std::memcpy(&w, src + i * Size, Size);
+            w = bswap(w);
+            std::memcpy(dst + i * Size, &w, Size);
+        }
+    }
+
+    inline void byte_swap_generic(
+        char const* src
+      , char* dst
+      , std::size_t n
+      , std::size_t size
+        )
+    {
+        for (std::size_t i = 0; i < n; ++i)
+            for (std::size_t b = 0; b < size; ++b)
+                dst[i * size + b] = src[i * size + (size - 1 - b)];
+    }
+
+    inline void byte_swap(
+        char const* src
+      , char* dst
+      , std::size_t n
+      , std::size_t size
+        )
+    {
+        switch (size)
+        {
+        case 1:
+            if (src != dst)
+                std::memcpy(dst, src, n);
+            break;
+        case 2: byte_swap_words<2>(src, dst, n); break;
+        case 4: byte_swap_words<4>(src, dst, n); break;
+        case 8: byte_swap_words<8>(src, dst, n); break;
+        default:
+            if (src != dst)
+                byte_swap_generic(src, dst, n, size);
+            else
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    char* first = dst + i * size;
+                    char* last = first + size - 1;
+                    for (; first < last; ++first, --last)
+                    {
+                        char x = *last;
+                        *last = *first;
+                        *first = x;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Copy n elements from src to dst, reversing the bytes of each element. dst
+// needn't be aligned.
+template <typename T>
+void byte_swap_copy(T const* src, void* dst, std::size_t n)
+{
+    detail::byte_swap(reinterpret_cast<char const*>(src)
+                    , reinterpret_cast<char*>(dst), n, sizeof(T));
+}
+
+// Reverse the bytes of each of the n elements at data.
+template <typename T>
+void byte_swap_inplace(T* data, std::size_t n)
+{
+    detail::byte_swap(reinterpret_cast<char const*>(data)
+                    , reinterpret_cast<char*>(data), n, sizeof(T));
+}
+
+#endif
@@ -0,0 +1,569 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z8B56F45D_C05F_4726_906F_70987A43402F)
+#define Z8B56F45D_C05F_4726_906F_70987A43402F
+
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+
+// Codecs for the large bitwise chunks of zero-copy messages (see
+// zero_copy_oarchive::codec()). A codec turns the n bytes of a vector of
+// element_size byte elements into something (hopefully) smaller, and back.
+// The receiver finds the codec of a chunk by the id that travels with it, so
+// both ends have to know the codec under the same id; chunk_codecs holds the
+// codecs known to a process.
+struct chunk_codec
+{
+    virtual ~chunk_codec() {}
+
+    // Travels with every chunk this codec encoded; 1 to 254. 0 means the
+    // chunk is sent as it is, and 255 that it isn't sent at all (see
+    // zero_copy_prelude::handoff).
+    virtual boost::uint8_t id() const = 0;
+
+    virtual char const* name() const = 0;
+
+    // Most bytes encode() produces from n bytes.
+    virtual std::size_t max_encoded_size(
+        std::size_t n
+      , std::size_t element_size
+        ) const = 0;
+
+    // Encode the n bytes at in into out, which holds max_encoded_size(n)
+    // bytes. Returns the number of bytes used.
+    virtual std::size_t encode(
+        void const* in
+      , std::size_t n
+      , std::size_t element_size
+      , char* out
+        ) const = 0;
+
+    // Decode the size bytes at in, which encode() made from exactly n bytes,
+    // into out. Returns false if the encoded data is corrupt.
+    virtual bool decode(
+        char const* in
+      , std::size_t size
+      , std::size_t element_size
+      , void* out
+      , std::size_t n
+        ) const = 0;
+};
+
+// Copies the chunk. This costs a copy on both ends and saves nothing, so it
+// is only of use for measuring what the codec stage itself costs.
+struct passthrough_codec : chunk_codec
+{
+    BOOST_STATIC_CONSTANT(boost::uint8_t, codec_id = 1);
+
+    boost::uint8_t id() const
+    {
+        return codec_id;
+    }
+
+    char const* name() const
+    {
+        return "copy";
+    }
+
+    std::size_t max_encoded_size(std::size_t n, std::size_t) const
+    {
+        return n;
+    }
+
+    std::size_t encode(
+        void const* in
+      , std::size_t n
+      , std::size_t
+      , char* out
+        ) const
+    {
+        std::memcpy(out, in, n);
+        return n;
+    }
+
+    bool decode(
+        char const* in
+      , std::size_t size
+      , std::size_t
+      , void* out
+      , std::size_t n
+        ) const
+    {
+        if (size != n)
+            return false;
+
+        std::memcpy(out, in, n);
+        return true;
+    }
+};
+
+namespace detail
+{
+    // The LZ stage works on blocks of up to this many bytes, so that a block
+    // and its shuffled copy stay in cache, and match offsets fit 16 bits.
+    const std::size_t lz_block = 64 * 1024;
+
+    const std::size_t lz_min_match = 4;
+    const std::size_t lz_hash_bits = 12;
+
+    // Elements larger than this are compressed without the shuffle.
+    const std::size_t lz_max_shuffle = 256;
+
+    // Every block starts with its encoded size, little endian. The top bit
+    // says the block is stored as it is, because it didn't compress.
+    const std::size_t lz_block_header = 4;
+    const boost::uint32_t lz_stored = 0x80000000u;
+
+    inline boost::uint32_t lz_load32(unsigned char const* p)
+    {
+        boost::uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline std::size_t lz_hash(boost::uint32_t v)
+    {
+        return (v * 2654435761u) >> (32 - lz_hash_bits);
+    }
+
+    // Bytes of the elements that the shuffle groups together.
+    inline std::size_t lz_stride(std::size_t element_size)
+    {
+        return (element_size <= lz_max_shuffle) ? element_size : 1;
+    }
+
+    // Uncompressed size of a block; a whole number of elements.
+    inline std::size_t lz_block_size(std::size_t element_size)
+    {
+        std::size_t const k = lz_stride(element_size);
+        return (lz_block / k) * k;
+    }
+
+    // Group the bytes of the elements by their position in the element: all
+    // first bytes, then all second bytes, and so on. In smooth floating point
+    // data the sign, exponent and leading mantissa bytes barely change from
+    // one element to the next, so they end up in long, repetitive runs.
+    inline void byte_shuffle(
+        unsigned char const* in
+      , std::size_t n
+      , std::size_t k
+      , unsigned char* out
+        )
+    {
+        std::size_t const elements = n / k;
+
+        for (std::size_t b = 0; b < k; ++b)
+            for (std::size_t e = 0; e < elements; ++e)
+                out[b * elements + e] = in[e * k + b];
+
+        std::memcpy(out + elements * k, in + elements * k, n - elements * k);
+    }
+
+    inline void byte_unshuffle(
+        unsigned char const* in
+      , std::size_t n
+      , std::size_t k
+      , unsigned char* out
+        )
+    {
+        std::size_t const elements = n / k;
+
+        for (std::size_t b = 0; b < k; ++b)
+            for (std::size_t e = 0; e < elements; ++e)
+                out[e * k + b] = in[b * elements + e];
+
+        std::memcpy(out + elements * k, in + elements * k, n - elements * k);
+    }
+
+    // Lengths that don't fit the 4 bits of the token continue in bytes of
+    // 255 and a final byte below 255.
+    inline bool lz_put_length(
+        unsigned char*& out
+      , unsigned char* end
+      , std::size_t n
+        )
+    {
+        for (; n >= 255; n -= 255)
+        {
+            if (out == end)
+                return false;
+            *out++ = 255;
+        }
+
+        if (out == end)
+            return false;
+        *out++ = (unsigned char)(n);
+        return true;
+    }
+
+    inline bool lz_get_length(
+        unsigned char const*& in
+      , unsigned char const* end
+      , std::size_t& n
+        )
+    {
+        unsigned char b;
+
+        do
+        {
+            if (in == end)
+                return false;
+            b = *in++;
+            n += b;
+        } while (255 == b);
+
+        return true;
+    }
+
+    // Write a sequence: a token with the literal length in the upper and the
+    // match length (less lz_min_match) in the lower four bits, the literals,
+    // and the match offset. The last sequence of a block has no match.
+    inline bool lz_put_sequence(
+        unsigned char*& out
+      , unsigned char* end
+      , unsigned char const* literals
+      , std::size_t literal_length
+      , std::size_t offset
+      , std::size_t match_length
+        )
+    {
+        std::size_t const match = offset ? match_length - lz_min_match : 0;
+
+        if (out == end)
+            return false;
+
+        *out++ = (unsigned char)(((std::min)(literal_length, std::size_t(15))
+                                  << 4)
+                               | (std::min)(match, std::size_t(15)));
+
+        if (   literal_length >= 15
+            && !lz_put_length(out, end, literal_length - 15))
+            return false;
+
+        if (std::size_t(end - out) < literal_length)
+            return false;
+
+        std::memcpy(out, literals, literal_length);
+        out += literal_length;
+
+        if (0 == offset)
+            return true;
+
+        if (end - out < 2)
+            return false;
+
+        *out++ = (unsigned char)(offset);
+        *out++ = (unsigned char)(offset >> 8);
+
+        return match < 15 || lz_put_length(out, end, match - 15);
+    }
+
+    // Greedy LZ77 with a single-entry hash table and 16-bit offsets. The step
+    // grows while no match turns up, so incompressible data is skipped over
+    // quickly. Returns the compressed size, or 0 if it would exceed capacity.
+    inline std::size_t lz_compress(
+        unsigned char const* in
+      , std::size_t n
+      , unsigned char* out
+      , std::size_t capacity
+        )
+    {
+        boost::uint32_t table[std::size_t(1) << lz_hash_bits];
+        std::fill(table, table + (std::size_t(1) << lz_hash_bits), 0);
+
+        unsigned char* o = out;
+        unsigned char* const end = out + capacity;
+
+        std::size_t anchor = 0; ///< First byte not yet written.
+        std::size_t ip = 0;
+        std::size_t misses = 0;
+
+        while (ip + lz_min_match <= n)
+        {
+            boost::uint32_t const v = lz_load32(in + ip);
+            std::size_t const h = lz_hash(v);
+            std::size_t const candidate = table[h];
+            table[h] = boost::uint32_t(ip);
+
+            if (   candidate < ip
+                && ip - candidate <= 0xffff
+                && lz_load32(in + candidate) == v)
+            {
+                std::size_t length = lz_min_match;
+                while (   ip + length < n
+                       && in[candidate + length] == in[ip + length])
+                    ++length;
+
+                if (!lz_put_sequence(o, end, in + anchor, ip - anchor
+                                   , ip - candidate, length))
+                    return 0;
+
+                ip += length;
+                anchor = ip;
+                misses = 0;
+                continue;
+            }
+
+            ip += 1 + (misses++ >> 5);
+        }
+
+        if (   anchor < n
+            && !lz_put_sequence(o, end, in + anchor, n - anchor, 0, 0))
+            return 0;
+
+        return std::size_t(o - out);
+    }
+
+    // Decompress size bytes into exactly n bytes at out.
+    inline bool lz_decompress(
+        unsigned char const* in
+      , std::size_t size
+      , unsigned char* out
+      , std::size_t n
+        )
+    {
+        unsigned char const* ip = in;
+        unsigned char const* const in_end = in + size;
+        unsigned char* op = out;
+        unsigned char* const out_end = out + n;
+
+        while (ip != in_end)
+        {
+            unsigned char const token = *ip++;
+
+            std::size_t literal_length = token >> 4;
+            if (   15 == literal_length
+                && !lz_get_length(ip, in_end, literal_length))
+                return false;
+
+            if (   std::size_t(in_end - ip) < literal_length
+                || std::size_t(out_end - op) < literal_length)
+                return false;
+
+            std::memcpy(op, ip, literal_length);
+            ip += literal_length;
+            op += literal_length;
+
+            if (ip == in_end)
+                break;
+
+            if (in_end - ip < 2)
+                return false;
+
+            std::size_t const offset = std::size_t(ip[0])
+                                     | (std::size_t(ip[1]) << 8);
+            ip += 2;
+
+            std::size_t length = token & 15;
+            if (15 == length && !lz_get_length(ip, in_end, length))
+                return false;
+            length += lz_min_match;
+
+            if (   0 == offset
+                || std::size_t(op - out) < offset
+                || std::size_t(out_end - op) < length)
+                return false;
+
+            unsigned char const* match = op - offset;
+
+            // Overlapping matches repeat the last offset bytes.
+            if (offset >= length)
+                std::memcpy(op, match, length);
+            else
+                for (std::size_t i = 0; i < length; ++i)
+                    op[i] = match[i];
+
+            op += length;
+        }
+
+        return op == out_end;
+    }
+
+    inline void lz_put_header(char* out, boost::uint32_t h)
+    {
+        for (std::size_t b = 0; b < lz_block_header; ++b)
+            out[b] = char(h >> (8 * b));
+    }
+
+    inline boost::uint32_t lz_get_header(char const* in)
+    {
+        boost::uint32_t h = 0;
+        for (std::size_t b = 0; b < lz_block_header; ++b)
+            h |= boost::uint32_t((unsigned char)(in[b])) << (8 * b);
+        return h;
+    }
+}
+
+// Byte shuffle followed by a fast LZ77 pass, block by block. Meant for smooth
+// floating point data, where the shuffle turns the slowly changing high bytes
+// of neighbouring elements into runs the LZ pass can take out. Blocks that
+// don't get smaller are stored as they are, so the output is never more than
+// a few bytes per block larger than the input.
+struct shuffle_lz_codec : chunk_codec
+{
+    BOOST_STATIC_CONSTANT(boost::uint8_t, codec_id = 2);
+
+    boost::uint8_t id() const
+    {
+        return codec_id;
+    }
+
+    char const* name() const
+    {
+        return "shuffle-lz";
+    }
+
+    std::size_t max_encoded_size(std::size_t n, std::size_t element_size) const
+    {
+        std::size_t const block = detail::lz_block_size(element_size);
+        return n + ((n + block - 1) / block) * detail::lz_block_header;
+    }
+
+    std::size_t encode(
+        void const* in
+      , std::size_t n
+      , std::size_t element_size
+      , char* out
+        ) const
+    {
+        unsigned char shuffled[detail::lz_block];
+
+        unsigned char const* const data = static_cast<unsigned char const*>(in);
+        std::size_t const k = detail::lz_stride(element_size);
+        std::size_t const block = detail::lz_block_size(element_size);
+
+        char* o = out;
+
+        for (std::size_t pos = 0; pos < n; pos += block)
+        {
+            std::size_t const length = (std::min)(block, n - pos);
+            char* const payload = o + detail::lz_block_header;
+
+            detail::byte_shuffle(data + pos, length, k, shuffled);
+
+            // Anything that isn't smaller is stored instead.
+            std::size_t const size = detail::lz_compress(shuffled, length
+              , reinterpret_cast<unsigned char*>(payload), length - 1);
+
+            if (0 != size)
+                detail::lz_put_header(o, boost::uint32_t(size));
+
+            else
+            {
+                detail::lz_put_header(o
+                  , boost::uint32_t(length) | detail::lz_stored);
+                std::memcpy(payload, data + pos, length);
+            }
+
+            o = payload + (size ? size : length);
+        }
+
+        return std::size_t(o - out);
+    }
+
+    bool decode(
+        char const* in
+      , std::size_t size
+      , std::size_t element_size
+      , void* out
+      , std::size_t n
+        ) const
+    {
+        unsigned char shuffled[detail::lz_block];
+
+        unsigned char* const data = static_cast<unsigned char*>(out);
+        std::size_t const k = detail::lz_stride(element_size);
+        std::size_t const block = detail::lz_block_size(element_size);
+
+        char const* ip = in;
+        char const* const end = in + size;
+
+        for (std::size_t pos = 0; pos < n; pos += block)
+        {
+            std::size_t const length = (std::min)(block, n - pos);
+
+            if (std::size_t(end - ip) < detail::lz_block_header)
+                return false;
+
+            boost::uint32_t const h = detail::lz_get_header(ip);
+            std::size_t const payload = h & ~detail::lz_stored;
+            ip += detail::lz_block_header;
+
+            if (std::size_t(end - ip) < payload)
+                return false;
+
+            if (h & detail::lz_stored)
+            {
+                if (payload != length)
+                    return false;
+                std::memcpy(data + pos, ip, length);
+            }
+
+            else
+            {
+                if (!detail::lz_decompress(
+                        reinterpret_cast<unsigned char const*>(ip), payload
+                      , shuffled, length))
+                    return false;
+                detail::byte_unshuffle(shuffled, length, k, data + pos);
+            }
+
+            ip += payload;
+        }
+
+        return ip == end;
+    }
+};
+
+// The codecs a process knows, by id. The built-in codecs are always there;
+// others have to be added on both ends before any archive uses them.
+struct chunk_codecs
+{
+  private:
+    boost::shared_ptr<chunk_codec> codecs_[256];
+
+  public:
+    chunk_codecs()
+    {
+        add(boost::shared_ptr<chunk_codec>(new passthrough_codec));
+        add(boost::shared_ptr<chunk_codec>(new shuffle_lz_codec));
+    }
+
+    static chunk_codecs& instance()
+    {
+        static chunk_codecs codecs;
+        return codecs;
+    }
+
+    void add(boost::shared_ptr<chunk_codec> const& c)
+    {
+        BOOST_ASSERT(c && 0 != c->id() && 255 != c->id());
+        codecs_[c->id()] = c;
+    }
+
+    // Returns a null pointer for unknown ids.
+    boost::shared_ptr<chunk_codec> find(boost::uint8_t id) const
+    {
+        return codecs_[id];
+    }
+
+    boost::shared_ptr<chunk_codec> find(std::string const& name) const
+    {
+        for (std::size_t i = 0; i < 256; ++i)
+            if (codecs_[i] && name == codecs_[i]->name())
+                return codecs_[i];
+        return boost::shared_ptr<chunk_codec>();
+    }
+};
+
+#endif
+
@@ -9,7 +9,6 @@
 #include <boost/ref.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
-#include <boost/iostreams/stream.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/serialization.hpp>
@@ -20,7 +19,8 @@
 
 #include <vector>
 
-#include "container_device.hpp"
+#include "direct_streambuf.hpp"
+#include "stream_transport.hpp"
 
 #include "portable_binary_iarchive.hpp"
 #include "portable_binary_oarchive.hpp"
@@ -32,53 +32,52 @@
 // over to this git repository.
 namespace boost { namespace integer { typedef boost::uint64_t ulittle64_t; }}
 
-struct control_case_oarchive
-  : boost::enable_shared_from_this<control_case_oarchive>
+template <typename Stream>
+struct basic_control_case_oarchive
+  : boost::enable_shared_from_this<basic_control_case_oarchive<Stream> >
 {
     typedef boost::mpl::false_ is_loading;
     typedef boost::mpl::true_ is_saving;
 
   private:
-    boost::asio::ip::tcp::socket* socket_;
+    Stream* socket_;
 
     std::vector<char> buffer_;
     boost::integer::ulittle64_t size_; // buffer_.size() 
 
   public:
-    control_case_oarchive(
-        boost::asio::ip::tcp::socket& socket
+    basic_control_case_oarchive(
+        Stream& socket
         )
       : socket_(&socket)
       , buffer_()
       , size_(0)
     {}
 
-    ~control_case_oarchive()
+    ~basic_control_case_oarchive()
     {
-        // Gracefully and portably shutdown the socket.
-        boost::system::error_code ec;
-        socket_->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-        socket_->close(ec);
+        close_stream(*socket_);
     }
 
     // Synchronously write a data structure to the socket.
     template <typename Parcel>
     void write(Parcel const& p)
     {
-        typedef container_device<std::vector<char> > io_device_type;
-        boost::iostreams::stream<io_device_type> io(buffer_);
+        // The buffer keeps its size between messages, so it only grows while
+        // the messages do.
+        vector_streambuf buffer(buffer_);
 
         {
             // Serialize the slow way.
-            portable_binary_oarchive archive(io);
+            portable_binary_oarchive archive(buffer, boost::archive::no_codecvt);
             archive & p;
         }
 
-        size_ = buffer_.size();
+        size_ = buffer.size();
 
         std::vector<boost::asio::const_buffer> message;
         message.push_back(boost::asio::buffer(&size_, sizeof(size_)));
-        message.push_back(boost::asio::buffer(buffer_));
+        message.push_back(boost::asio::buffer(buffer.data(), buffer.size()));
 
         boost::asio::write(*socket_, message);
 
@@ -86,35 +85,37 @@ struct control_case_oarchive
     }
 };
 
+typedef basic_control_case_oarchive<boost::asio::ip::tcp::socket>
+    control_case_oarchive;
+
 // Note: We must "deserialize" the object BEFORE we read the data, but AFTER
 // we have read the sizes. This allows us to do zero-copy, because we know the
 // layout of the data structure before we call async_read.
-struct control_case_iarchive : boost::enable_shared_from_this<control_case_oarchive>
+template <typename Stream>
+struct basic_control_case_iarchive
+  : boost::enable_shared_from_this<basic_control_case_iarchive<Stream> >
 {
     typedef boost::mpl::true_ is_loading;
     typedef boost::mpl::false_ is_saving;
 
   private:
-    boost::asio::ip::tcp::socket* socket_;
+    Stream* socket_;
 
     std::vector<char> buffer_;
     boost::integer::ulittle64_t size_; // buffer_.size() 
 
   public:
-    control_case_iarchive(
-        boost::asio::ip::tcp::socket& socket 
+    basic_control_case_iarchive(
+        Stream& socket 
         )
       : socket_(&socket)
       , buffer_()
       , size_(0)
     {}
 
-    ~control_case_iarchive()
+    ~basic_control_case_iarchive()
     {
-        // Gracefully and portably shutdown the socket.
-        boost::system::error_code ec;
-        socket_->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-        socket_->close(ec);
+        close_stream(*socket_);
     }
 
     // Synchronously read a data structure from the socket.
@@ -124,16 +125,16 @@ struct control_case_iarchive : boost::enable_shared_from_this<control_case_oarch
         // The first thing we need is the size of the incoming data. 
         boost::asio::read(*socket_, boost::asio::buffer(&size_, sizeof(size_)));
 
-        buffer_.resize(size_);
+        if (buffer_.size() < size_)
+            buffer_.resize(size_);
 
-        boost::asio::read(*socket_, boost::asio::buffer(buffer_));
+        boost::asio::read(*socket_, boost::asio::buffer(&buffer_[0], size_));
 
-        typedef container_device<std::vector<char> > io_device_type;
-        boost::iostreams::stream<io_device_type> io(buffer_);
+        array_streambuf buffer(&buffer_[0], size_);
 
         {
             // Deserialize the slow way.
-            portable_binary_oarchive archive(io);
+            portable_binary_iarchive archive(buffer, boost::archive::no_codecvt);
             archive & p;
         }
 
@@ -141,5 +142,8 @@ struct control_case_iarchive : boost::enable_shared_from_this<control_case_oarch
     }
 };
 
+typedef basic_control_case_iarchive<boost::asio::ip::tcp::socket>
+    control_case_iarchive;
+
 #endif
 
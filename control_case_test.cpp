@@ -8,6 +8,7 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 
 #include "control_case_archive.hpp"
+#include "shm_transport.hpp"
 #include "high_resolution_timer.hpp"
 
 #include <boost/lexical_cast.hpp>
@@ -23,6 +24,7 @@
 
 #include <sched.h>
 #include <time.h>
+#include <unistd.h>
 
 using boost::program_options::variables_map;
 using boost::program_options::options_description;
@@ -32,6 +34,7 @@ using boost::program_options::command_line_parser;
 using boost::program_options::notify;
 
 using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
 
 #if defined(CHECK_DATA)
     std::vector<double> correct_data;
@@ -48,10 +51,76 @@ using boost::asio::ip::tcp;
     }
 #endif
 
+// Where the server listens: a TCP port on all interfaces, or for
+// --transport=unix and shm a socket file, which is removed first in case an
+// earlier run left it behind.
+template <typename Protocol>
+typename Protocol::endpoint listen_endpoint(variables_map& vm);
+
+template <>
+tcp::endpoint listen_endpoint<tcp>(variables_map& vm)
+{
+    return tcp::endpoint(tcp::v4(), boost::lexical_cast<boost::uint16_t>
+        (vm["port"].as<std::string>()));
+}
+
+template <>
+stream_protocol::endpoint listen_endpoint<stream_protocol>(variables_map& vm)
+{
+    std::string path = vm["socket-path"].as<std::string>();
+    ::unlink(path.c_str());
+    return stream_protocol::endpoint(path);
+}
+
+template <>
+shm_protocol::endpoint listen_endpoint<shm_protocol>(variables_map& vm)
+{
+    return listen_endpoint<stream_protocol>(vm);
+}
+
+// Where the client connects to.
+template <typename Protocol>
+typename Protocol::endpoint connect_endpoint(
+    boost::asio::io_service& io_service
+  , variables_map& vm
+    );
+
+template <>
+tcp::endpoint connect_endpoint<tcp>(
+    boost::asio::io_service& io_service
+  , variables_map& vm
+    )
+{
+    // Resolve the target's address.
+    tcp::resolver resolver(io_service);
+    tcp::resolver::query query(tcp::v4(), vm["host"].as<std::string>()
+                             , vm["port"].as<std::string>());
+    return resolver.resolve(query)->endpoint();
+}
+
+template <>
+stream_protocol::endpoint connect_endpoint<stream_protocol>(
+    boost::asio::io_service&
+  , variables_map& vm
+    )
+{
+    return stream_protocol::endpoint(vm["socket-path"].as<std::string>());
+}
+
+template <>
+shm_protocol::endpoint connect_endpoint<shm_protocol>(
+    boost::asio::io_service& io_service
+  , variables_map& vm
+    )
+{
+    return connect_endpoint<stream_protocol>(io_service, vm);
+}
+
 // Receive, then send.
+template <typename Stream>
 void receive(
-    control_case_oarchive& sender
-  , control_case_iarchive& receiver
+    basic_control_case_oarchive<Stream>& sender
+  , basic_control_case_iarchive<Stream>& receiver
   , std::vector<double>& data
   , boost::uint64_t iteration
     )
@@ -81,9 +150,10 @@ void receive(
 }
 
 // Send, then receive. 
+template <typename Stream>
 void send(
-    control_case_oarchive& sender
-  , control_case_iarchive& receiver
+    basic_control_case_oarchive<Stream>& sender
+  , basic_control_case_iarchive<Stream>& receiver
   , std::vector<double>& data
   , boost::uint64_t iteration
     )
@@ -125,35 +195,35 @@ void generate_data(
     std::generate_n(it, vector_size, boost::bind(dst, boost::ref(prng))); 
 }
 
-std::string server_main(variables_map& vm)
+template <typename Protocol>
+std::string run_server(variables_map& vm)
 {
-    std::string host = vm["host"].as<std::string>();
-    boost::uint16_t port = boost::lexical_cast<boost::uint16_t>
-        (vm["port"].as<std::string>());
- 
+    typedef typename Protocol::socket socket_type;
+    typedef typename Protocol::acceptor acceptor_type;
+
+    std::string transport = vm["transport"].as<std::string>();
+
     boost::uint64_t vector_size = vm["vector-size"].as<boost::uint64_t>();
     boost::uint64_t iterations = vm["iterations"].as<boost::uint64_t>();
     boost::uint64_t seed = vm["seed"].as<boost::uint64_t>();
  
     boost::asio::io_service io_service;
 
-    tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), port));
-    acceptor.set_option(tcp::acceptor::reuse_address(true));
-    acceptor.set_option(tcp::acceptor::linger(true, 0));
+    acceptor_type acceptor(io_service, listen_endpoint<Protocol>(vm));
+    acceptor.set_option(typename acceptor_type::reuse_address(true));
+    acceptor.set_option(typename acceptor_type::linger(true, 0));
 
-    tcp::socket s(io_service);
-    control_case_oarchive sender(s);
-    control_case_iarchive receiver(s);
+    socket_type s(io_service);
+    basic_control_case_oarchive<socket_type> sender(s);
+    basic_control_case_iarchive<socket_type> receiver(s);
 
     // Start accepting connections.
     acceptor.accept(s);
 
-    // Generate a vector of doubles filled with random data.
+    // Generate a vector of doubles filled with random data. The server sends
+    // first.
     std::vector<double> data;
-
-#if defined(CHECK_DATA)
-    generate_data(correct_data, vector_size, seed);
-#endif
+    generate_data(data, vector_size, seed);
 
     // Start timing.
     high_resolution_timer clock;
@@ -169,43 +239,40 @@ std::string server_main(variables_map& vm)
     double elapsed = clock.elapsed();
 
     return boost::str(boost::format(
-        "server seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s]"
-        ) % seed % vector_size % iterations % elapsed);
+        "server seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s] "
+        "transport=%5%"
+        ) % seed % vector_size % iterations % elapsed % transport);
 }
 
-std::string client_main(variables_map& vm)
+template <typename Protocol>
+std::string run_client(variables_map& vm)
 {
-    std::string host = vm["host"].as<std::string>();
-    std::string port = vm["port"].as<std::string>();
- 
+    typedef typename Protocol::socket socket_type;
+
+    std::string transport = vm["transport"].as<std::string>();
+
     boost::uint64_t vector_size = vm["vector-size"].as<boost::uint64_t>();
     boost::uint64_t iterations = vm["iterations"].as<boost::uint64_t>();
     boost::uint64_t seed = vm["seed"].as<boost::uint64_t>();
 
     boost::asio::io_service io_service;
 
-    // Resolve the target's address.
-    tcp::resolver resolver(io_service);
-    tcp::resolver::query query(tcp::v4(), host, port);
-    tcp::resolver::iterator iterator = resolver.resolve(query);
+    typename Protocol::endpoint endpoint
+        = connect_endpoint<Protocol>(io_service, vm);
 
-    tcp::socket s(io_service);
-    control_case_oarchive sender(s);
-    control_case_iarchive receiver(s);
+    socket_type s(io_service);
+    basic_control_case_oarchive<socket_type> sender(s);
+    basic_control_case_iarchive<socket_type> receiver(s);
 
     // Connect to the target.
-    boost::asio::connect(s, iterator);
-    s.set_option(tcp::socket::reuse_address(true));
-    s.set_option(tcp::socket::linger(true, 0));
+    s.connect(endpoint);
+    s.set_option(typename socket_type::reuse_address(true));
+    s.set_option(typename socket_type::linger(true, 0));
 
     // Generate a vector of doubles filled with random data.
     std::vector<double> data;
     generate_data(data, vector_size, seed);
 
-#if defined(CHECK_DATA)
-    generate_data(correct_data, vector_size, seed);
-#endif
-
     // Start timing.
     high_resolution_timer clock;
 
@@ -220,8 +287,31 @@ std::string client_main(variables_map& vm)
     double elapsed = clock.elapsed();
 
     return boost::str(boost::format(
-        "server seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s]"
-        ) % seed % vector_size % iterations % elapsed);
+        "client seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s] "
+        "transport=%5%"
+        ) % seed % vector_size % iterations % elapsed % transport);
+}
+
+std::string server_main(variables_map& vm)
+{
+    std::string const transport = vm["transport"].as<std::string>();
+
+    if ("unix" == transport)
+        return run_server<stream_protocol>(vm);
+    if ("shm" == transport)
+        return run_server<shm_protocol>(vm);
+    return run_server<tcp>(vm);
+}
+
+std::string client_main(variables_map& vm)
+{
+    std::string const transport = vm["transport"].as<std::string>();
+
+    if ("unix" == transport)
+        return run_client<stream_protocol>(vm);
+    if ("shm" == transport)
+        return run_client<shm_protocol>(vm);
+    return run_client<tcp>(vm);
 }
 
 int main(int argc, char** argv)
@@ -250,6 +340,15 @@ int main(int argc, char** argv)
         , value<std::string>()->default_value("9000")
         , "TCP port to connect to")
 
+        ( "transport"
+        , value<std::string>()->default_value("tcp")
+        , "connection to send over: tcp, unix (a UNIX domain socket) or shm "
+          "(shared memory)")
+
+        ( "socket-path"
+        , value<std::string>()->default_value("/tmp/control_case_test.socket")
+        , "socket file of --transport=unix and shm")
+
         ( "vector-size", value<boost::uint64_t>()->default_value(128),
           "number of elements (doubles) to send/receive")
 
@@ -288,6 +387,22 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    std::string const transport = vm["transport"].as<std::string>();
+
+    if ("tcp" != transport && "unix" != transport && "shm" != transport)
+    {
+        std::cout << "ERROR: unknown transport '" << transport << "'\n"
+                  << cmdline;
+        return 1;
+    }
+
+#if defined(CHECK_DATA)
+    // Made once, before either end starts, as both ends of --both check
+    // against it.
+    generate_data(correct_data, vm["vector-size"].as<boost::uint64_t>()
+                , vm["seed"].as<boost::uint64_t>());
+#endif
+
     if      (vm.count("server"))
         std::cout << server_main(vm) << "\n";
     else if (vm.count("client"))
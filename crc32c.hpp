@@ -0,0 +1,268 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z0B83051B_5D17_4278_9803_F82AB12949A2)
+#define Z0B83051B_5D17_4278_9803_F82AB12949A2
+
+#include <boost/cstdint.hpp>
+#include <boost/detail/endian.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+
+#if defined(__SSE4_2__)
+    #include <nmmintrin.h>
+    #define ZERO_COPY_CRC32C_SSE42
+#endif
+
+// CRC32C (Castagnoli), the checksum of zero-copy message bodies. With SSE4.2
+// (make NATIVE=1) it is computed with the crc32 instruction, on three
+// interleaved streams so that the latency of the instruction is hidden; the
+// three partial CRCs are merged with precomputed shift tables. Otherwise we
+// fall back to slicing-by-8 tables.
+
+namespace detail
+{
+    const boost::uint32_t crc32c_polynomial = 0x82f63b78; ///< Reflected.
+
+    // Bytes per stream of the interleaved loop. Both must be powers of two.
+    const std::size_t crc32c_long = 8192;
+    const std::size_t crc32c_short = 256;
+
+    inline boost::uint32_t gf2_matrix_times(
+        boost::uint32_t const* matrix
+      , boost::uint32_t v
+        )
+    {
+        boost::uint32_t sum = 0;
+
+        for (; 0 != v; v >>= 1, ++matrix)
+            if (v & 1)
+                sum ^= *matrix;
+
+        return sum;
+    }
+
+    inline void gf2_matrix_square(
+        boost::uint32_t* square
+      , boost::uint32_t const* matrix
+        )
+    {
+        for (std::size_t n = 0; n < 32; ++n)
+            square[n] = gf2_matrix_times(matrix, matrix[n]);
+    }
+
+    // The operator that appends n zero bytes to a CRC, as a 32x32 matrix over
+    // GF(2); n is a power of two.
+    inline void crc32c_zeros_operator(boost::uint32_t* even, std::size_t n)
+    {
+        boost::uint32_t odd[32];
+
+        // One zero bit.
+        odd[0] = crc32c_polynomial;
+        for (std::size_t i = 1; i < 32; ++i)
+            odd[i] = boost::uint32_t(1) << (i - 1);
+
+        // Two, then four zero bits.
+        gf2_matrix_square(even, odd);
+        gf2_matrix_square(odd, even);
+
+        // The first square gives one zero byte, each following one doubles
+        // it.
+        do
+        {
+            gf2_matrix_square(even, odd);
+            n >>= 1;
+            if (0 == n)
+                return;
+
+            gf2_matrix_square(odd, even);
+            n >>= 1;
+        } while (0 != n);
+
+        std::copy(odd, odd + 32, even);
+    }
+
+    struct crc32c_tables
+    {
+        boost::uint32_t slices[8][256];       ///< Slicing-by-8.
+        boost::uint32_t long_shift[4][256];   ///< Append crc32c_long zeros.
+        boost::uint32_t short_shift[4][256];  ///< Append crc32c_short zeros.
+
+        crc32c_tables()
+        {
+            for (boost::uint32_t n = 0; n < 256; ++n)
+            {
+                boost::uint32_t crc = n;
+                for (std::size_t k = 0; k < 8; ++k)
+                    crc = (crc & 1) ? (crc >> 1) ^ crc32c_polynomial
+                                    : (crc >> 1);
+                slices[0][n] = crc;
+            }
+
+            for (std::size_t n = 0; n < 256; ++n)
+                for (std::size_t k = 1; k < 8; ++k)
+                    slices[k][n] = slices[0][slices[k - 1][n] & 0xff]
+                                 ^ (slices[k - 1][n] >> 8);
+
+            shift_table(long_shift, crc32c_long);
+            shift_table(short_shift, crc32c_short);
+        }
+
+      private:
+        static void shift_table(boost::uint32_t (*table)[256], std::size_t n)
+        {
+            boost::uint32_t op[32];
+            crc32c_zeros_operator(op, n);
+
+            for (boost::uint32_t v = 0; v < 256; ++v)
+                for (std::size_t b = 0; b < 4; ++b)
+                    table[b][v] = gf2_matrix_times(op, v << (8 * b));
+        }
+    };
+
+    inline crc32c_tables const& crc32c_table()
+    {
+        static crc32c_tables const tables;
+        return tables;
+    }
+
+    inline boost::uint32_t crc32c_shift(
+        boost::uint32_t const (*table)[256]
+      , boost::uint32_t crc
+        )
+    {
+        return table[0][crc & 0xff]
+             ^ table[1][(crc >> 8) & 0xff]
+             ^ table[2][(crc >> 16) & 0xff]
+             ^ table[3][crc >> 24];
+    }
+
+    inline boost::uint64_t crc32c_load64(unsigned char const* p)
+    {
+        boost::uint64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+#if defined(ZERO_COPY_CRC32C_SSE42)
+    inline boost::uint32_t crc32c_update8(
+        boost::uint32_t crc
+      , boost::uint64_t v
+        )
+    {
+        return boost::uint32_t(_mm_crc32_u64(crc, v));
+    }
+
+    // Run the crc32 instruction over three adjacent streams of block bytes
+    // each, for as long as there are three of them left.
+    inline boost::uint32_t crc32c_interleaved(
+        boost::uint32_t crc
+      , unsigned char const*& p
+      , std::size_t& n
+      , std::size_t block
+      , boost::uint32_t const (*shift)[256]
+        )
+    {
+        while (n >= 3 * block)
+        {
+            boost::uint32_t crc1 = 0;
+            boost::uint32_t crc2 = 0;
+
+            for (unsigned char const* end = p + block; p != end; p += 8)
+            {
+                crc = crc32c_update8(crc, crc32c_load64(p));
+                crc1 = crc32c_update8(crc1, crc32c_load64(p + block));
+                crc2 = crc32c_update8(crc2, crc32c_load64(p + 2 * block));
+            }
+
+            crc = crc32c_shift(shift, crc) ^ crc1;
+            crc = crc32c_shift(shift, crc) ^ crc2;
+
+            p += 2 * block;
+            n -= 3 * block;
+        }
+
+        return crc;
+    }
+#endif
+}
+
+// Continue the CRC32C crc (0 to start) over n bytes at data.
+inline boost::uint32_t crc32c(
+    boost::uint32_t crc
+  , void const* data
+  , std::size_t n
+    )
+{
+    detail::crc32c_tables const& tables = detail::crc32c_table();
+
+    unsigned char const* p = static_cast<unsigned char const*>(data);
+
+    crc = ~crc;
+
+#if defined(ZERO_COPY_CRC32C_SSE42)
+    crc = detail::crc32c_interleaved(crc, p, n, detail::crc32c_long
+                                   , tables.long_shift);
+    crc = detail::crc32c_interleaved(crc, p, n, detail::crc32c_short
+                                   , tables.short_shift);
+
+    for (; n >= 8; p += 8, n -= 8)
+        crc = detail::crc32c_update8(crc, detail::crc32c_load64(p));
+
+    for (; 0 != n; ++p, --n)
+        crc = _mm_crc32_u8(crc, *p);
+#else
+  #if !defined(BOOST_BIG_ENDIAN)
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        boost::uint64_t const v = crc ^ detail::crc32c_load64(p);
+
+        crc = tables.slices[7][v & 0xff]
+            ^ tables.slices[6][(v >> 8) & 0xff]
+            ^ tables.slices[5][(v >> 16) & 0xff]
+            ^ tables.slices[4][(v >> 24) & 0xff]
+            ^ tables.slices[3][(v >> 32) & 0xff]
+            ^ tables.slices[2][(v >> 40) & 0xff]
+            ^ tables.slices[1][(v >> 48) & 0xff]
+            ^ tables.slices[0][v >> 56];
+    }
+  #endif
+
+    for (; 0 != n; ++p, --n)
+        crc = tables.slices[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+#endif
+
+    return ~crc;
+}
+
+// Copy n bytes from src to dest, and continue the CRC32C crc over them. The
+// copy is done a cache-sized piece at a time, and each piece is checksummed
+// right after it has been written, while it is still in the L1 cache.
+inline boost::uint32_t crc32c_copy(
+    boost::uint32_t crc
+  , void* dest
+  , void const* src
+  , std::size_t n
+    )
+{
+    std::size_t const piece = 4096;
+
+    char* d = static_cast<char*>(dest);
+    char const* s = static_cast<char const*>(src);
+
+    for (std::size_t done = 0; done < n; done += piece)
+    {
+        std::size_t const m = (std::min)(piece, n - done);
+        std::memcpy(d + done, s + done, m);
+        crc = crc32c(crc, d + done, m);
+    }
+
+    return crc;
+}
+
+#endif
+
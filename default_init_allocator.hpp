@@ -0,0 +1,60 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z8D5F2A63_E14B_4C07_93A8_B6C1E47D0F29)
+#define Z8D5F2A63_E14B_4C07_93A8_B6C1E47D0F29
+
+#include <memory>
+#include <new>
+#include <utility>
+
+// An allocator adaptor that default-initializes instead of value-initializing
+// the elements a container creates without a value. For a std::vector of
+// fundamental types this means resize(n) leaves the new elements
+// uninitialized instead of zeroing them, which is what zero_copy_iarchive
+// wants: the elements of a received vector are overwritten by the socket
+// right after the resize, so zeroing them is a wasted pass over the memory.
+template <typename T, typename Allocator = std::allocator<T> >
+struct default_init_allocator : Allocator
+{
+    typedef std::allocator_traits<Allocator> traits;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef default_init_allocator<
+            U, typename traits::template rebind_alloc<U>
+        > other;
+    };
+
+    default_init_allocator() {}
+
+    default_init_allocator(Allocator const& a)
+      : Allocator(a)
+    {}
+
+    template <typename U, typename OtherAllocator>
+    default_init_allocator(
+        default_init_allocator<U, OtherAllocator> const& a
+        )
+      : Allocator(static_cast<OtherAllocator const&>(a))
+    {}
+
+    template <typename U>
+    void construct(U* p)
+    {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        traits::construct(static_cast<Allocator&>(*this), p
+                        , std::forward<Args>(args)...);
+    }
+};
+
+#endif
+
@@ -0,0 +1,177 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z3B7D0F85_C41A_4E6B_9A28_E6F51C02D9B4)
+#define Z3B7D0F85_C41A_4E6B_9A28_E6F51C02D9B4
+
+#include <boost/assert.hpp>
+
+#include <streambuf>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+
+// Stream buffers for the slow path. Boost.Serialization archives can be built
+// directly on a std::streambuf, so there's no need for a std::ostream or a
+// Boost.Iostreams device in between; every save_binary()/load_binary() of the
+// archive ends up as one memcpy here.
+
+// Writes into a std::vector<char>. The vector is used as raw storage and is
+// never shrunk, so once it has grown to fit the traffic, writing doesn't touch
+// the heap. Only the first size() bytes of it are valid.
+struct vector_streambuf : std::streambuf
+{
+  private:
+    std::vector<char>& buffer_;
+
+  public:
+    vector_streambuf(std::vector<char>& buffer, std::size_t size_hint = 0)
+      : buffer_(buffer)
+    {
+        if (buffer_.size() < size_hint)
+            buffer_.resize(size_hint);
+
+        put_area(0);
+    }
+
+    // Number of bytes written so far.
+    std::size_t size() const
+    {
+        return std::size_t(pptr() - pbase());
+    }
+
+    char const* data() const
+    {
+        return pbase();
+    }
+
+  protected:
+    int_type overflow(int_type c)
+    {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+
+        grow(1);
+
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+        return c;
+    }
+
+    std::streamsize xsputn(char const* s, std::streamsize n)
+    {
+        if (n <= 0)
+            return 0;
+
+        if (epptr() - pptr() < n)
+            grow(std::size_t(n));
+
+        std::memcpy(pptr(), s, std::size_t(n));
+        put_area(size() + std::size_t(n));
+        return n;
+    }
+
+    pos_type seekoff(
+        off_type off
+      , std::ios_base::seekdir way
+      , std::ios_base::openmode which
+        )
+    {
+        // Only telling the position is supported.
+        if (0 == off && std::ios_base::cur == way && (which & std::ios_base::out))
+            return pos_type(off_type(size()));
+        return pos_type(off_type(-1));
+    }
+
+  private:
+    // Make room for n more bytes; the storage at least doubles.
+    void grow(std::size_t n)
+    {
+        std::size_t const offset = size();
+        buffer_.resize((std::max)(offset + n, 2 * buffer_.size()));
+        put_area(offset);
+    }
+
+    void put_area(std::size_t offset)
+    {
+        char* begin = buffer_.empty() ? 0 : &buffer_[0];
+        setp(begin, begin + buffer_.size());
+
+        while (offset > std::size_t((std::numeric_limits<int>::max)()))
+        {
+            pbump((std::numeric_limits<int>::max)());
+            offset -= (std::numeric_limits<int>::max)();
+        }
+
+        pbump(int(offset));
+    }
+};
+
+// Throws away everything written to it and only counts the bytes. An archive
+// on top of it tells how large its output would be.
+struct counting_streambuf : std::streambuf
+{
+  private:
+    std::size_t size_;
+
+  public:
+    counting_streambuf()
+      : size_(0)
+    {}
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+  protected:
+    int_type overflow(int_type c)
+    {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+
+        ++size_;
+        return c;
+    }
+
+    std::streamsize xsputn(char const*, std::streamsize n)
+    {
+        size_ += std::size_t(n);
+        return n;
+    }
+};
+
+// Reads straight from memory that is owned by someone else, e.g. the arena
+// buffer a message was received into. Nothing is copied until the archive
+// asks for the bytes.
+struct array_streambuf : std::streambuf
+{
+    array_streambuf(char const* data, std::size_t size)
+    {
+        char* p = const_cast<char*>(data);
+        setg(p, p, p + size);
+    }
+
+  protected:
+    std::streamsize xsgetn(char* s, std::streamsize n)
+    {
+        n = (std::min)(n, std::streamsize(egptr() - gptr()));
+
+        if (n <= 0)
+            return 0;
+
+        std::memcpy(s, gptr(), std::size_t(n));
+        setg(eback(), gptr() + n, egptr());
+        return n;
+    }
+
+    std::streamsize showmanyc()
+    {
+        return (gptr() == egptr()) ? -1 : std::streamsize(egptr() - gptr());
+    }
+};
+
+#endif
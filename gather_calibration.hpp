@@ -0,0 +1,102 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z4C9E2D17_3A6B_4F85_B0D2_96E1C8A7F354)
+#define Z4C9E2D17_3A6B_4F85_B0D2_96E1C8A7F354
+
+#include <boost/cstdint.hpp>
+
+#include <vector>
+#include <cstring>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "zero_copy_archive.hpp"
+#include "scatter_gather_io.hpp"
+#include "high_resolution_timer.hpp"
+
+// Find the field size up to which copying fields into one contiguous buffer
+// is cheaper on this host than handing each of them to the kernel as an iovec
+// of its own. Both variants write the same bytes to an AF_UNIX socket; only
+// the writes are timed, the socket is drained in between. The result is meant
+// for gather_threshold().
+inline std::size_t calibrate_gather_threshold(
+    std::size_t max_size = 4096
+  , std::size_t fields = 16
+    )
+{
+    int fds[2];
+
+    if (0 != ::socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        return zero_copy_oarchive::default_gather_threshold;
+
+    // Each timed write has to fit into the socket buffer, or we would be
+    // measuring the reader.
+    int sndbuf = int(4 * max_size * fields);
+    ::setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    std::vector<char> source(max_size * fields, 'x');
+    std::vector<char> staging(max_size * fields);
+    std::vector<char> sink(max_size * fields);
+    std::vector<iovec> iov(fields);
+
+    std::size_t threshold = 0;
+    std::size_t syscalls = 0;
+
+    for (std::size_t size = 8; size <= max_size; size *= 2)
+    {
+        std::size_t const bytes = size * fields;
+        std::size_t const iterations
+            = (std::max)(std::size_t(64), (std::size_t(1) << 22) / bytes);
+
+        boost::uint64_t gather = 0;
+        boost::uint64_t copy = 0;
+
+        for (std::size_t i = 0; i < iterations; ++i)
+        {
+            // One iovec per field.
+            boost::uint64_t start = high_resolution_clock::now();
+
+            for (std::size_t f = 0; f < fields; ++f)
+            {
+                iov[f].iov_base = &source[f * size];
+                iov[f].iov_len = size;
+            }
+
+            gather_write(fds[0], &iov[0], fields);
+
+            gather += high_resolution_clock::now() - start;
+
+            read_at_least(fds[1], &sink[0], bytes, bytes, syscalls);
+
+            // Copy the fields into a staging buffer and write that.
+            start = high_resolution_clock::now();
+
+            for (std::size_t f = 0; f < fields; ++f)
+                std::memcpy(&staging[f * size], &source[f * size], size);
+
+            iovec whole = { &staging[0], bytes };
+            gather_write(fds[0], &whole, 1);
+
+            copy += high_resolution_clock::now() - start;
+
+            read_at_least(fds[1], &sink[0], bytes, bytes, syscalls);
+        }
+
+        if (copy > gather)
+            break;
+
+        threshold = size;
+    }
+
+    ::close(fds[0]);
+    ::close(fds[1]);
+
+    return threshold;
+}
+
+#endif
@@ -0,0 +1,122 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z9D3E5A48_0C7B_4E21_A6F9_2B8D41C7E063)
+#define Z9D3E5A48_0C7B_4E21_A6F9_2B8D41C7E063
+
+#include <boost/asio.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/detail/endian.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include <limits>
+#include <cstring>
+#include <cstddef>
+
+// Everything about the local platform that decides whether a bitwise copy of
+// a fundamental type means the same thing on the other end. It is made of
+// single bytes only, so it can be compared without knowing the peer's
+// endianness.
+struct platform_fingerprint
+{
+    BOOST_STATIC_CONSTANT(std::size_t, types = 12);
+
+    boost::uint8_t magic;
+    boost::uint8_t version;
+    boost::uint8_t endianness;   ///< 1 for little endian, 2 for big endian.
+    boost::uint8_t float_format; ///< Bit mask of the IEEE 754 types.
+    boost::uint8_t sizes[types];
+    boost::uint8_t alignments[types];
+};
+
+namespace detail
+{
+    template <typename T>
+    void fingerprint_type(platform_fingerprint& f, std::size_t i)
+    {
+        f.sizes[i] = boost::uint8_t(sizeof(T));
+        f.alignments[i] = boost::uint8_t(boost::alignment_of<T>::value);
+    }
+}
+
+inline platform_fingerprint local_platform_fingerprint()
+{
+    platform_fingerprint f;
+    std::memset(&f, 0, sizeof(f));
+
+    f.magic = 'Z';
+    f.version = 1;
+
+#if defined(BOOST_BIG_ENDIAN)
+    f.endianness = 2;
+#else
+    f.endianness = 1;
+#endif
+
+    f.float_format = boost::uint8_t(
+        (std::numeric_limits<float>::is_iec559 ? 1 : 0)
+      | (std::numeric_limits<double>::is_iec559 ? 2 : 0)
+      | (std::numeric_limits<long double>::is_iec559 ? 4 : 0));
+
+    detail::fingerprint_type<bool>(f, 0);
+    detail::fingerprint_type<char>(f, 1);
+    detail::fingerprint_type<wchar_t>(f, 2);
+    detail::fingerprint_type<short>(f, 3);
+    detail::fingerprint_type<int>(f, 4);
+    detail::fingerprint_type<long>(f, 5);
+    detail::fingerprint_type<long long>(f, 6);
+    detail::fingerprint_type<float>(f, 7);
+    detail::fingerprint_type<double>(f, 8);
+    detail::fingerprint_type<long double>(f, 9);
+    detail::fingerprint_type<void*>(f, 10);
+    detail::fingerprint_type<std::size_t>(f, 11);
+
+    return f;
+}
+
+// How bitwise data of this platform relates to the peer's.
+enum peer_layout
+{
+    heterogeneous_peer, ///< Different type sizes or formats; no bitwise data.
+    homogeneous_peer,   ///< Identical; bitwise data can be used as is.
+    byte_swapped_peer   ///< Identical except for the byte order.
+};
+
+// Exchange platform fingerprints with the peer. Both ends send theirs before
+// reading the other one, so this costs one round trip. Call it once right
+// after the connection is established, before any archive uses the socket,
+// and hand the result to the archives' peer() setter.
+template <typename Stream>
+inline peer_layout negotiate_peer_layout(Stream& socket)
+{
+    platform_fingerprint const local = local_platform_fingerprint();
+    platform_fingerprint remote;
+
+    boost::asio::write(socket, boost::asio::buffer(&local, sizeof(local)));
+    boost::asio::read(socket, boost::asio::buffer(&remote, sizeof(remote)));
+
+    if (0 == std::memcmp(&local, &remote, sizeof(local)))
+        return homogeneous_peer;
+
+    // If only the byte order differs and float and double are IEEE 754 on
+    // both ends, reversing the bytes of each element is all it takes.
+    platform_fingerprint swapped = remote;
+    swapped.endianness = local.endianness;
+
+    if (  0 == std::memcmp(&local, &swapped, sizeof(local))
+       && 3 == (local.float_format & 3))
+        return byte_swapped_peer;
+
+    return heterogeneous_peer;
+}
+
+// Returns true when it is safe to serialize bitwise without any conversion.
+template <typename Stream>
+inline bool negotiate_homogeneity(Stream& socket)
+{
+    return homogeneous_peer == negotiate_peer_layout(socket);
+}
+
+#endif
@@ -15,7 +15,12 @@
 #include <boost/cstdint.hpp>
 #include <boost/serialization/pfto.hpp>
 #include <boost/static_assert.hpp>
+#include <boost/mpl/bool.hpp>
 
+#include <boost/type_traits/is_signed.hpp>
+#include <boost/type_traits/make_unsigned.hpp>
+
+#include <cstddef>
 #include <climits>
 #if CHAR_BIT != 8
 #error This code assumes an eight-bit byte.
@@ -25,6 +30,8 @@
 #include <boost/detail/endian.hpp>
 
 enum portable_binary_archive_flags {
+    integer_stream_vbyte = 0x1000,
+    integer_compact   = 0x2000,
     endian_big        = 0x4000,
     endian_little     = 0x8000
 };
@@ -40,4 +47,93 @@ reverse_bytes(char size, char *address){
     }
 }
 
+/////////1/////////2/////////3/////////4/////////5/////////6/////////7/////////8
+// Compact encoding of integer arrays. Archives with an explicit byte order or
+// with integer_compact set write integer arrays in blocks of up to
+// compact_block elements. Each block starts with one byte holding the width
+// of its widest element, followed by every element of the block in exactly
+// that many bytes, in the archive's byte order. Signed values are zigzag
+// encoded first, so that small negative numbers stay narrow. This replaces a
+// size byte and a byte reversal per element with one per block.
+
+const std::size_t compact_block = 64;
+
+template <typename T>
+inline boost::uint64_t
+compact_zigzag(T t, boost::mpl::true_){
+    typedef typename boost::make_unsigned<T>::type unsigned_type;
+    unsigned_type u = static_cast<unsigned_type>(t);
+    return static_cast<unsigned_type>(
+        static_cast<unsigned_type>(u << 1) ^ (t < 0 ? ~unsigned_type(0) : 0));
+}
+
+template <typename T>
+inline boost::uint64_t
+compact_zigzag(T t, boost::mpl::false_){
+    return static_cast<boost::uint64_t>(t);
+}
+
+template <typename T>
+inline T
+compact_unzigzag(boost::uint64_t u, boost::mpl::true_){
+    typedef typename boost::make_unsigned<T>::type unsigned_type;
+    unsigned_type const x = static_cast<unsigned_type>(u);
+    return static_cast<T>(static_cast<unsigned_type>(
+        (x >> 1) ^ static_cast<unsigned_type>(-static_cast<unsigned_type>(x & 1))));
+}
+
+template <typename T>
+inline T
+compact_unzigzag(boost::uint64_t u, boost::mpl::false_){
+    return static_cast<T>(u);
+}
+
+// Encode count (at most compact_block) elements into out, which must hold
+// 1 + count * sizeof(T) bytes. Returns the number of bytes used.
+template <typename T>
+inline std::size_t
+compact_encode(T const* in, std::size_t count, bool big, unsigned char* out){
+    typedef typename boost::is_signed<T>::type is_signed;
+
+    boost::uint64_t values[compact_block];
+    boost::uint64_t all = 0;
+    for(std::size_t i = 0; i < count; ++i){
+        values[i] = compact_zigzag(in[i], is_signed());
+        all |= values[i];
+    }
+
+    unsigned char width = 0;
+    for(/**/; all != 0; all >>= CHAR_BIT)
+        ++width;
+
+    *out++ = width;
+    for(std::size_t i = 0; i < count; ++i){
+        for(unsigned char b = 0; b < width; ++b){
+            unsigned char const shift = big ? (width - 1 - b) : b;
+            *out++ = static_cast<unsigned char>(values[i] >> (shift * CHAR_BIT));
+        }
+    }
+
+    return 1 + count * width;
+}
+
+// Decode count elements of the given width from in.
+template <typename T>
+inline void
+compact_decode(
+    unsigned char const* in, std::size_t count, unsigned char width, bool big,
+    T* out
+){
+    typedef typename boost::is_signed<T>::type is_signed;
+
+    for(std::size_t i = 0; i < count; ++i){
+        boost::uint64_t u = 0;
+        for(unsigned char b = 0; b < width; ++b){
+            unsigned char const shift = big ? (width - 1 - b) : b;
+            u |= static_cast<boost::uint64_t>(*in++) << (shift * CHAR_BIT);
+        }
+        out[i] = compact_unzigzag<T>(u, is_signed());
+    }
+}
+
 #endif // PORTABLE_BINARY_ARCHIVE_HPP
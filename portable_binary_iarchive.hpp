@@ -26,8 +26,11 @@
 //  See http://www.boost.org for updates, documentation, and revision history.
 
 #include <istream>
+#include <algorithm>
+#include <boost/throw_exception.hpp>
 #include <boost/utility/enable_if.hpp>
 #include <boost/type_traits/is_integral.hpp>
+#include <boost/type_traits/is_same.hpp>
 #include <boost/serialization/array.hpp>
 #include <boost/serialization/string.hpp>
 #include <boost/archive/archive_exception.hpp>
@@ -50,6 +53,7 @@
 #endif
 
 #include "portable_binary_archive.hpp"
+#include "stream_vbyte.hpp"
 
 /////////1/////////2/////////3/////////4/////////5/////////6/////////7/////////8
 // exception to be thrown if integer read from archive doesn't fit
@@ -267,6 +271,54 @@ public:
     // the optimized load_array dispatches to load_binary 
     template <typename T>
     void load_array(boost::serialization::array<T>& a, unsigned int)
+    {
+        load_array_impl(a, boost::mpl::bool_<
+            boost::is_integral<T>::value && !boost::is_same<T, bool>::value
+        >());
+    }
+
+    // integers are read as one block in native order, or decoded if the
+    // archive has a byte order (see compact_encode and stream_vbyte_encode)
+    template <typename T>
+    void load_array_impl(boost::serialization::array<T>& a, boost::mpl::true_)
+    {
+        if ((m_flags & integer_stream_vbyte) && sizeof(T) <= 4) {
+            T* p = a.address();
+            unsigned char control[stream_vbyte_control_size];
+            unsigned char data[stream_vbyte_block * 4 + stream_vbyte_padding];
+            for (std::size_t i = 0; i < a.count(); i += stream_vbyte_block) {
+                std::size_t const count =
+                    (std::min)(a.count() - i, stream_vbyte_block);
+                this->primitive_base_t::load_binary(control, (count + 3) / 4);
+                this->primitive_base_t::load_binary(data,
+                    stream_vbyte_data_size(control, count));
+                stream_vbyte_decode(control, data, count, p + i);
+            }
+        }
+        else if (m_flags & (endian_big | endian_little | integer_compact
+                                                  | integer_stream_vbyte)) {
+            T* p = a.address();
+            bool const big = 0 != (m_flags & endian_big);
+            unsigned char block[compact_block * sizeof(T)];
+            for (std::size_t i = 0; i < a.count(); i += compact_block) {
+                std::size_t const count =
+                    (std::min)(a.count() - i, compact_block);
+                unsigned char width = 0;
+                this->primitive_base_t::load_binary(&width, 1);
+                if (width > sizeof(T)) {
+                    BOOST_THROW_EXCEPTION(portable_binary_iarchive_exception());
+                }
+                this->primitive_base_t::load_binary(block, count * width);
+                compact_decode(block, count, width, big, p + i);
+            }
+        }
+        else {
+            this->primitive_base_t::load_binary(a.address(), a.count()*sizeof(T));
+        }
+    }
+
+    template <typename T>
+    void load_array_impl(boost::serialization::array<T>& a, boost::mpl::false_)
     {
         // If we need to potentially flip bytes we serialize each element 
         // separately.
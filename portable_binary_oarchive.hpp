@@ -26,8 +26,10 @@
 //  See http://www.boost.org for updates, documentation, and revision history.
 
 #include <ostream>
+#include <algorithm>
 #include <boost/utility/enable_if.hpp>
 #include <boost/type_traits/is_integral.hpp>
+#include <boost/type_traits/is_same.hpp>
 #include <boost/serialization/array.hpp>
 #include <boost/serialization/string.hpp>
 #include <boost/archive/archive_exception.hpp>
@@ -49,6 +51,7 @@
 #endif
 
 #include "portable_binary_archive.hpp"
+#include "stream_vbyte.hpp"
 
 /////////1/////////2/////////3/////////4/////////5/////////6/////////7/////////8
 // exception to be thrown if integer read from archive doesn't fit
@@ -222,7 +225,8 @@ public:
             0 != (flags & boost::archive::no_codecvt)
         ),
         archive_base_t(flags),
-        m_flags(flags & (endian_big | endian_little))
+        m_flags(flags & (endian_big | endian_little | integer_compact
+                 | integer_stream_vbyte))
     {
         init(flags);
     }
@@ -238,7 +242,8 @@ public:
             0 != (flags & boost::archive::no_codecvt)
         ),
         archive_base_t(flags),
-        m_flags(0)
+        m_flags(flags & (endian_big | endian_little | integer_compact
+                 | integer_stream_vbyte))
     {
         init(flags);
     }
@@ -248,6 +253,49 @@ public:
     // default fall through for any types not specified here
     template <typename T>
     void save_array(boost::serialization::array<T> const& a, unsigned int)
+    {
+        save_array_impl(a, boost::mpl::bool_<
+            boost::is_integral<T>::value && !boost::is_same<T, bool>::value
+        >());
+    }
+
+    // integers are written as one block in native order, or compactly
+    // encoded if the archive has a byte order (see compact_encode and
+    // stream_vbyte_encode)
+    template <typename T>
+    void save_array_impl(boost::serialization::array<T> const& a, boost::mpl::true_)
+    {
+        if ((m_flags & integer_stream_vbyte) && sizeof(T) <= 4) {
+            T const* p = a.address();
+            unsigned char block[stream_vbyte_control_size + stream_vbyte_block * 4];
+            for (std::size_t i = 0; i < a.count(); i += stream_vbyte_block) {
+                std::size_t const count =
+                    (std::min)(a.count() - i, stream_vbyte_block);
+                std::size_t const bytes =
+                    stream_vbyte_encode(p + i, count, block);
+                this->primitive_base_t::save_binary(block, bytes);
+            }
+        }
+        else if (m_flags & (endian_big | endian_little | integer_compact
+                                                  | integer_stream_vbyte)) {
+            T const* p = a.address();
+            bool const big = 0 != (m_flags & endian_big);
+            unsigned char block[1 + compact_block * sizeof(T)];
+            for (std::size_t i = 0; i < a.count(); i += compact_block) {
+                std::size_t const count =
+                    (std::min)(a.count() - i, compact_block);
+                std::size_t const bytes =
+                    compact_encode(p + i, count, big, block);
+                this->primitive_base_t::save_binary(block, bytes);
+            }
+        }
+        else {
+            this->primitive_base_t::save_binary(a.address(), a.count()*sizeof(T));
+        }
+    }
+
+    template <typename T>
+    void save_array_impl(boost::serialization::array<T> const& a, boost::mpl::false_)
     {
         // If we need to potentially flip bytes we serialize each element 
         // separately.
@@ -0,0 +1,287 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z7F2B6C90_1E4D_4A3B_8D75_C30A9E5B21D6)
+#define Z7F2B6C90_1E4D_4A3B_8D75_C30A9E5B21D6
+
+#include <boost/asio.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <vector>
+#include <algorithm>
+
+#include <cerrno>
+#include <climits>
+
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Native Linux scatter/gather I/O for the synchronous zero-copy paths. Asio's
+// reactive sockets hand at most 64 buffers to the kernel per writev/readv, so
+// a wide message quietly turns into many system calls. These functions pass up
+// to IOV_MAX buffers per call, deal with partial transfers and EAGAIN on
+// non-blocking sockets themselves, and count every system call they make.
+// A peer that has gone away is reported as EPIPE, never as SIGPIPE.
+
+#if defined(IOV_MAX)
+    #define ZERO_COPY_IOV_MAX IOV_MAX
+#else
+    #define ZERO_COPY_IOV_MAX 1024
+#endif
+
+namespace detail
+{
+    inline void throw_errno()
+    {
+        boost::system::error_code ec(errno,
+            boost::asio::error::get_system_category());
+        throw boost::system::system_error(ec);
+    }
+
+    // Block until fd is ready for events. Returns the number of system calls.
+    inline std::size_t wait_for(int fd, short events)
+    {
+        pollfd p = { fd, events, 0 };
+
+        std::size_t syscalls = 0;
+
+        for (;;)
+        {
+            ++syscalls;
+
+            if (::poll(&p, 1, -1) >= 0)
+                return syscalls;
+
+            if (EINTR != errno)
+                throw_errno();
+        }
+    }
+
+    // writev(), except that writing to a socket whose peer has gone away
+    // fails with EPIPE instead of raising SIGPIPE. Other file descriptors,
+    // like pipes, fall back to writev() (at the cost of a failed sendmsg()).
+    inline ssize_t write_iovecs(int fd, iovec* iov, int count)
+    {
+#if defined(MSG_NOSIGNAL)
+        msghdr m = msghdr();
+        m.msg_iov = iov;
+        m.msg_iovlen = count;
+
+        ssize_t const n = ::sendmsg(fd, &m, MSG_NOSIGNAL);
+
+        if (n >= 0 || ENOTSOCK != errno)
+            return n;
+#endif
+
+        return ::writev(fd, iov, count);
+    }
+
+    // Drop the first n bytes from the iovec array [iov, iov + count).
+    inline void consume_iovecs(iovec*& iov, std::size_t& count, std::size_t n)
+    {
+        while (count > 0 && n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Append an Asio buffer sequence to an iovec array, skipping empty buffers.
+template <typename BufferSequence>
+void append_iovecs(BufferSequence const& buffers, std::vector<iovec>& iovs)
+{
+    typename BufferSequence::const_iterator it = buffers.begin();
+    typename BufferSequence::const_iterator end = buffers.end();
+
+    for (; it != end; ++it)
+    {
+        boost::asio::const_buffer b(*it);
+
+        std::size_t const size = boost::asio::buffer_size(b);
+
+        if (0 == size)
+            continue;
+
+        iovec v;
+        v.iov_base = const_cast<void*>(
+            boost::asio::buffer_cast<void const*>(b));
+        v.iov_len = size;
+        iovs.push_back(v);
+    }
+}
+
+// Convert an Asio buffer sequence into an iovec array, skipping empty buffers.
+template <typename BufferSequence>
+void to_iovecs(BufferSequence const& buffers, std::vector<iovec>& iovs)
+{
+    iovs.clear();
+    append_iovecs(buffers, iovs);
+}
+
+// Write all of [iov, iov + count) to fd. The iovecs are modified. Returns the
+// number of system calls made.
+inline std::size_t gather_write(int fd, iovec* iov, std::size_t count)
+{
+    std::size_t syscalls = 0;
+
+    while (count > 0)
+    {
+        int const batch = int((std::min)(count
+                                       , std::size_t(ZERO_COPY_IOV_MAX)));
+
+        ++syscalls;
+        ssize_t const n = detail::write_iovecs(fd, iov, batch);
+
+        if (n < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                syscalls += detail::wait_for(fd, POLLOUT);
+            else if (EINTR != errno)
+                detail::throw_errno();
+            continue;
+        }
+
+        detail::consume_iovecs(iov, count, std::size_t(n));
+    }
+
+    return syscalls;
+}
+
+// Write as much of [iov, iov + count) to the non-blocking fd as it takes
+// without blocking. The iovecs are modified. Returns the number of bytes
+// written; syscalls is incremented for each system call.
+inline std::size_t gather_write_some(
+    int fd
+  , iovec* iov
+  , std::size_t count
+  , std::size_t& syscalls
+    )
+{
+    std::size_t bytes = 0;
+
+    while (count > 0)
+    {
+        int const batch = int((std::min)(count
+                                       , std::size_t(ZERO_COPY_IOV_MAX)));
+
+        ++syscalls;
+        ssize_t const n = detail::write_iovecs(fd, iov, batch);
+
+        if (n < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+            else if (EINTR != errno)
+                detail::throw_errno();
+            continue;
+        }
+
+        bytes += std::size_t(n);
+        detail::consume_iovecs(iov, count, std::size_t(n));
+    }
+
+    return bytes;
+}
+
+// Fill all of [iov, iov + count) from fd. The iovecs are modified. Returns the
+// number of system calls made.
+inline std::size_t scatter_read(int fd, iovec* iov, std::size_t count)
+{
+    std::size_t syscalls = 0;
+
+    while (count > 0)
+    {
+        int const batch = int((std::min)(count
+                                       , std::size_t(ZERO_COPY_IOV_MAX)));
+
+        ++syscalls;
+        ssize_t const n = ::readv(fd, iov, batch);
+
+        if (n < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                syscalls += detail::wait_for(fd, POLLIN);
+            else if (EINTR != errno)
+                detail::throw_errno();
+            continue;
+        }
+
+        if (0 == n)
+            throw boost::system::system_error(boost::asio::error::eof);
+
+        detail::consume_iovecs(iov, count, std::size_t(n));
+    }
+
+    return syscalls;
+}
+
+// Read at least min and at most size bytes from fd into data. Returns the
+// number of bytes read; syscalls is incremented for each system call.
+inline std::size_t read_at_least(
+    int fd
+  , char* data
+  , std::size_t size
+  , std::size_t min
+  , std::size_t& syscalls
+    )
+{
+    std::size_t bytes = 0;
+
+    while (bytes < min)
+    {
+        ++syscalls;
+        ssize_t const n = ::read(fd, data + bytes, size - bytes);
+
+        if (n < 0)
+        {
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                syscalls += detail::wait_for(fd, POLLIN);
+            else if (EINTR != errno)
+                detail::throw_errno();
+            continue;
+        }
+
+        if (0 == n)
+            throw boost::system::system_error(boost::asio::error::eof);
+
+        bytes += std::size_t(n);
+    }
+
+    return bytes;
+}
+
+// gather_write() and scatter_read() as function objects, for passing them
+// around (see stripe_workers). The call is resolved when the handle type is
+// known, so the overloads for other kinds of handles (see
+// stream_transport.hpp) are found by argument dependent lookup.
+struct gather_writer
+{
+    template <typename Handle>
+    std::size_t operator()(Handle h, iovec* iov, std::size_t count) const
+    {
+        return gather_write(h, iov, count);
+    }
+};
+
+struct scatter_reader
+{
+    template <typename Handle>
+    std::size_t operator()(Handle h, iovec* iov, std::size_t count) const
+    {
+        return scatter_read(h, iov, count);
+    }
+};
+
+#endif
@@ -0,0 +1,1290 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(ZD8F5DCB1_B20F_4F51_B1A8_126C7FB0348E)
+#define ZD8F5DCB1_B20F_4F51_B1A8_126C7FB0348E
+
+#include <boost/asio.hpp>
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/futex.h>
+
+#include "scatter_gather_io.hpp"
+
+// Shared-memory transport for peers on the same host. Every connection gets a
+// POSIX shared memory region of its own, created by the connecting end and
+// handed to the accepting end over a UNIX domain socket (SCM_RIGHTS); the name
+// is unlinked right away, so nothing is left behind. The region holds one
+// single-producer/single-consumer byte ring per direction. A sender copies
+// the buffers of a message straight from the parcel into the ring, and the
+// receiver copies them straight out of it into the parcel; there are no
+// system calls in between, and no kernel buffers. A peer that finds the ring
+// full or empty polls it for a while, then sleeps on a futex, which the other
+// end only wakes if somebody is asleep.
+//
+// shm_stream has the native handle based gather_write(), scatter_read() and
+// read_at_least() overloads below, and read_some()/write_some(), so the
+// synchronous write()/read() of the archives work over it unchanged.
+// NOTE: There is no reactor behind a shm_stream, so it has no async_*
+// operations; async_write(), async_read() and receive() need a socket.
+//
+// The ring saves the kernel's copies, not the archives' own: what goes through
+// it is still copied once into it and once out of it. Large vectors can skip
+// both. A region may also hold a heap of whole pages, shared by both ends (see
+// shm_stream::heap_size()). A vector allocated in it with shm_allocator is
+// handed off by zero_copy_oarchive: only the offset of its block travels, and
+// the receiving zero_copy_iarchive makes that block the storage of its own
+// vector, which also has to use shm_allocator. A block is freed when the last
+// vector on either end lets go of it, and the mapping of the region stays
+// until then, even after the connection is closed.
+// NOTE: A vector that has been handed off shares its pages with the
+// receiver, so the sender must leave its elements alone afterwards: drop it,
+// or move or swap another vector into it. Copy assignment may reuse the pages.
+// NOTE: The block of a message that is never read stays allocated until the
+// region is unmapped.
+
+// Header of one direction of a connection, followed by the ring's bytes.
+// head and tail count all the bytes ever written and read.
+struct shm_ring
+{
+    // Written by the producer.
+    std::atomic<boost::uint64_t> head;
+    std::atomic<boost::uint32_t> head_event;      ///< Futex word.
+    std::atomic<boost::uint32_t> consumer_waiting;
+    char pad0[64 - 16];
+
+    // Written by the consumer.
+    std::atomic<boost::uint64_t> tail;
+    std::atomic<boost::uint32_t> tail_event;      ///< Futex word.
+    std::atomic<boost::uint32_t> producer_waiting;
+    char pad1[64 - 16];
+
+    shm_ring()
+      : head(0)
+      , head_event(0)
+      , consumer_waiting(0)
+      , tail(0)
+      , tail_event(0)
+      , producer_waiting(0)
+    {}
+};
+
+// Bookkeeping of the first page of each block of the shared heap.
+struct shm_block
+{
+    std::atomic<boost::uint32_t> references; ///< 0 if the page is free.
+    boost::uint32_t pages;
+};
+
+struct shm_region
+{
+    BOOST_STATIC_CONSTANT(boost::uint64_t, magic_value = 0x7a63736d72696e67);
+    BOOST_STATIC_CONSTANT(std::size_t, page_size = 4096);
+
+    boost::uint64_t magic;
+    boost::uint64_t ring_size;  ///< Bytes in each ring; a power of two.
+    boost::uint64_t heap_pages; ///< Of the shared heap; may be 0.
+    boost::uint64_t heap_hint;  ///< Page the next allocation starts looking
+                                ///  at. Under heap_lock.
+    std::atomic<boost::uint32_t> closed;
+    std::atomic<boost::uint32_t> heap_lock;
+    char pad[64 - 40];
+
+    shm_region(std::size_t size, std::size_t pages)
+      : magic(magic_value)
+      , ring_size(size)
+      , heap_pages(pages)
+      , heap_hint(0)
+      , closed(0)
+      , heap_lock(0)
+    {}
+
+    // The connecting end writes to ring 0 and reads from ring 1.
+    shm_ring* ring(std::size_t n)
+    {
+        char* p = reinterpret_cast<char*>(this + 1);
+        return reinterpret_cast<shm_ring*>(
+            p + n * (sizeof(shm_ring) + ring_size));
+    }
+
+    char* ring_data(std::size_t n)
+    {
+        return reinterpret_cast<char*>(ring(n) + 1);
+    }
+
+    // The rings are followed by the heap's index, a bitmap of the pages in
+    // use and a shm_block for each page; the pages start at the next page
+    // boundary.
+    static std::size_t heap_index_offset(std::size_t ring_size)
+    {
+        return sizeof(shm_region) + 2 * (sizeof(shm_ring) + ring_size);
+    }
+
+    static std::size_t heap_offset(std::size_t ring_size, std::size_t pages)
+    {
+        std::size_t const index_end = heap_index_offset(ring_size)
+            + (pages + 63) / 64 * sizeof(boost::uint64_t)
+            + pages * sizeof(shm_block);
+        return (index_end + page_size - 1) / page_size * page_size;
+    }
+
+    static std::size_t mapping_size(std::size_t ring_size, std::size_t pages)
+    {
+        if (0 == pages)
+            return heap_index_offset(ring_size);
+        return heap_offset(ring_size, pages) + pages * page_size;
+    }
+
+    boost::uint64_t* heap_bitmap()
+    {
+        return reinterpret_cast<boost::uint64_t*>(
+            reinterpret_cast<char*>(this)
+          + heap_index_offset(std::size_t(ring_size)));
+    }
+
+    shm_block* heap_blocks()
+    {
+        return reinterpret_cast<shm_block*>(
+            heap_bitmap() + (heap_pages + 63) / 64);
+    }
+
+    char* heap()
+    {
+        return reinterpret_cast<char*>(this) + heap_offset(
+            std::size_t(ring_size), std::size_t(heap_pages));
+    }
+};
+
+BOOST_STATIC_ASSERT(sizeof(shm_ring) == 128);
+BOOST_STATIC_ASSERT(sizeof(shm_region) == 64);
+BOOST_STATIC_ASSERT(sizeof(std::atomic<boost::uint32_t>) == 4);
+BOOST_STATIC_ASSERT(sizeof(shm_block) == 8);
+
+struct shm_heap;
+
+// One end of a connection; this is the native handle of a shm_stream.
+struct shm_channel
+{
+    shm_region* region;
+    shm_heap* heap;
+    shm_ring* in;
+    char* in_data;
+    shm_ring* out;
+    char* out_data;
+    std::size_t capacity; ///< Of each ring.
+    int control;          ///< The UNIX domain socket, to notice dead peers.
+};
+
+namespace detail
+{
+    // Polls of the ring before a peer goes to sleep on the futex.
+    const std::size_t shm_spin = 1024;
+
+    // How long to sleep on the futex before checking the peer is still
+    // there.
+    const long shm_liveness_ns = 100 * 1000 * 1000;
+
+    inline bool shm_peer_gone(shm_channel& c, std::size_t& syscalls)
+    {
+        // Nothing is ever sent over the control socket after the region has
+        // been handed over, so it only becomes readable when the peer exits.
+        pollfd p = { c.control, POLLIN | POLLRDHUP, 0 };
+
+        ++syscalls;
+        if (::poll(&p, 1, 0) <= 0 || 0 == p.revents)
+            return false;
+
+        c.region->closed.store(1);
+        return true;
+    }
+
+    inline void shm_wake(
+        std::atomic<boost::uint32_t>& event
+      , std::size_t& syscalls
+        )
+    {
+        event.fetch_add(1);
+
+        ++syscalls;
+        ::syscall(SYS_futex, reinterpret_cast<boost::uint32_t*>(&event)
+                , FUTEX_WAKE, INT_MAX, 0, 0, 0);
+    }
+
+    // Close both directions of the region, and wake everyone asleep on it.
+    inline void shm_close(shm_region& region, std::size_t& syscalls)
+    {
+        region.closed.store(1);
+
+        for (std::size_t n = 0; n < 2; ++n)
+        {
+            shm_ring& r = *region.ring(n);
+            shm_wake(r.head_event, syscalls);
+            shm_wake(r.tail_event, syscalls);
+        }
+    }
+
+    // Wake the other end if it is asleep on event.
+    inline void shm_notify(
+        std::atomic<boost::uint32_t>& event
+      , std::atomic<boost::uint32_t>& waiting
+      , std::size_t& syscalls
+        )
+    {
+        if (0 != waiting.load())
+            shm_wake(event, syscalls);
+    }
+
+    // Block until counter moves away from value. The other end bumps event
+    // and wakes us whenever it moves counter while waiting is set. Returns
+    // false if the connection was closed first.
+    inline bool shm_wait(
+        shm_channel& c
+      , std::atomic<boost::uint64_t> const& counter
+      , boost::uint64_t value
+      , std::atomic<boost::uint32_t>& event
+      , std::atomic<boost::uint32_t>& waiting
+      , std::size_t& syscalls
+        )
+    {
+        for (std::size_t i = 0; i < shm_spin; ++i)
+            if (counter.load(std::memory_order_acquire) != value)
+                return true;
+
+        for (;;)
+        {
+            boost::uint32_t const e = event.load();
+
+            // NOTE: Both waiting and counter are sequentially consistent, so
+            // either we see the new counter or the other end sees waiting.
+            waiting.store(1);
+
+            if (counter.load() != value)
+            {
+                waiting.store(0);
+                return true;
+            }
+
+            if (0 != c.region->closed.load())
+            {
+                waiting.store(0);
+                return false;
+            }
+
+            timespec timeout = { 0, shm_liveness_ns };
+
+            ++syscalls;
+            long const r = ::syscall(SYS_futex
+              , reinterpret_cast<boost::uint32_t*>(&event)
+              , FUTEX_WAIT, e, &timeout, 0, 0);
+
+            if (r < 0 && ETIMEDOUT == errno && shm_peer_gone(c, syscalls))
+            {
+                waiting.store(0);
+                return false;
+            }
+        }
+    }
+
+    // Copy n bytes from the iovecs into the ring at position pos.
+    inline void shm_copy_in(
+        char* ring
+      , std::size_t capacity
+      , boost::uint64_t pos
+      , iovec const* iov
+      , std::size_t n
+        )
+    {
+        for (; 0 != n; ++iov)
+        {
+            char const* src = static_cast<char const*>(iov->iov_base);
+            std::size_t len = (std::min)(n, iov->iov_len);
+            n -= len;
+
+            while (0 != len)
+            {
+                std::size_t const at = std::size_t(pos & (capacity - 1));
+                std::size_t const m = (std::min)(len, capacity - at);
+                std::memcpy(ring + at, src, m);
+                pos += m;
+                src += m;
+                len -= m;
+            }
+        }
+    }
+
+    // Copy n bytes from the ring at position pos into the iovecs.
+    inline void shm_copy_out(
+        char const* ring
+      , std::size_t capacity
+      , boost::uint64_t pos
+      , iovec const* iov
+      , std::size_t n
+        )
+    {
+        for (; 0 != n; ++iov)
+        {
+            char* dest = static_cast<char*>(iov->iov_base);
+            std::size_t len = (std::min)(n, iov->iov_len);
+            n -= len;
+
+            while (0 != len)
+            {
+                std::size_t const at = std::size_t(pos & (capacity - 1));
+                std::size_t const m = (std::min)(len, capacity - at);
+                std::memcpy(dest, ring + at, m);
+                pos += m;
+                dest += m;
+                len -= m;
+            }
+        }
+    }
+
+    inline std::size_t total_size(iovec const* iov, std::size_t count)
+    {
+        std::size_t n = 0;
+        for (std::size_t i = 0; i < count; ++i)
+            n += iov[i].iov_len;
+        return n;
+    }
+
+    // Write as much of [iov, iov + count) as there is room for, waiting for
+    // room if the ring is full. At most a quarter of the ring is published at
+    // a time, so the reader can start copying out before the ring is full.
+    // Returns the number of bytes written.
+    inline std::size_t shm_write_some(
+        shm_channel& c
+      , iovec const* iov
+      , std::size_t count
+      , std::size_t& syscalls
+        )
+    {
+        shm_ring& r = *c.out;
+
+        if (0 != c.region->closed.load())
+            throw boost::system::system_error(boost::asio::error::broken_pipe);
+
+        boost::uint64_t const head = r.head.load(std::memory_order_relaxed);
+        boost::uint64_t tail = r.tail.load(std::memory_order_acquire);
+
+        if (head - tail == c.capacity)
+        {
+            if (!shm_wait(c, r.tail, tail, r.tail_event, r.producer_waiting
+                        , syscalls))
+                throw boost::system::system_error(
+                    boost::asio::error::broken_pipe);
+
+            tail = r.tail.load(std::memory_order_acquire);
+        }
+
+        std::size_t const n = (std::min)(total_size(iov, count)
+          , (std::min)(std::size_t(c.capacity - (head - tail))
+                     , c.capacity / 4));
+
+        shm_copy_in(c.out_data, c.capacity, head, iov, n);
+
+        r.head.store(head + n);
+        shm_notify(r.head_event, r.consumer_waiting, syscalls);
+
+        return n;
+    }
+
+    // Read as much into [iov, iov + count) as there is in the ring, waiting
+    // for data if it is empty. Returns the number of bytes read.
+    inline std::size_t shm_read_some(
+        shm_channel& c
+      , iovec const* iov
+      , std::size_t count
+      , std::size_t& syscalls
+        )
+    {
+        shm_ring& r = *c.in;
+
+        boost::uint64_t const tail = r.tail.load(std::memory_order_relaxed);
+        boost::uint64_t head = r.head.load(std::memory_order_acquire);
+
+        if (head == tail)
+        {
+            if (!shm_wait(c, r.head, head, r.head_event, r.consumer_waiting
+                        , syscalls))
+                throw boost::system::system_error(boost::asio::error::eof);
+
+            head = r.head.load(std::memory_order_acquire);
+        }
+
+        std::size_t const n = (std::min)(total_size(iov, count)
+                                       , std::size_t(head - tail));
+
+        shm_copy_out(c.in_data, c.capacity, tail, iov, n);
+
+        r.tail.store(tail + n);
+        shm_notify(r.tail_event, r.producer_waiting, syscalls);
+
+        return n;
+    }
+
+    // Pass fd over the UNIX domain socket control.
+    inline void send_fd(int control, int fd)
+    {
+        char byte = 0;
+        iovec v = { &byte, 1 };
+
+        char space[CMSG_SPACE(sizeof(int))];
+        std::memset(space, 0, sizeof(space));
+
+        msghdr m;
+        std::memset(&m, 0, sizeof(m));
+        m.msg_iov = &v;
+        m.msg_iovlen = 1;
+        m.msg_control = space;
+        m.msg_controllen = sizeof(space);
+
+        cmsghdr* h = CMSG_FIRSTHDR(&m);
+        h->cmsg_level = SOL_SOCKET;
+        h->cmsg_type = SCM_RIGHTS;
+        h->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(h), &fd, sizeof(int));
+
+        while (::sendmsg(control, &m, MSG_NOSIGNAL) < 0)
+            if (EINTR != errno)
+                throw_errno();
+    }
+
+    inline int receive_fd(int control)
+    {
+        char byte = 0;
+        iovec v = { &byte, 1 };
+
+        char space[CMSG_SPACE(sizeof(int))];
+
+        msghdr m;
+        std::memset(&m, 0, sizeof(m));
+        m.msg_iov = &v;
+        m.msg_iovlen = 1;
+        m.msg_control = space;
+        m.msg_controllen = sizeof(space);
+
+        ssize_t n;
+        while ((n = ::recvmsg(control, &m, 0)) < 0)
+            if (EINTR != errno)
+                throw_errno();
+
+        cmsghdr* h = CMSG_FIRSTHDR(&m);
+
+        if (  0 == n || 0 == h || SOL_SOCKET != h->cmsg_level
+           || SCM_RIGHTS != h->cmsg_type)
+            throw boost::system::system_error(boost::asio::error::eof);
+
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(h), sizeof(int));
+        return fd;
+    }
+
+    // Create an anonymous shared memory object of the given size.
+    inline int shm_create(std::size_t size)
+    {
+        static std::atomic<unsigned> counter(0);
+
+        int fd;
+
+        for (;;)
+        {
+            char name[64];
+            std::sprintf(name, "/zero_copy_shm.%ld.%u"
+                       , long(::getpid()), counter.fetch_add(1));
+
+            fd = ::shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+            if (fd >= 0)
+            {
+                ::shm_unlink(name);
+                break;
+            }
+
+            if (EEXIST != errno)
+                throw_errno();
+        }
+
+        if (::ftruncate(fd, off_t(size)) < 0)
+        {
+            int const e = errno;
+            ::close(fd);
+            errno = e;
+            throw_errno();
+        }
+
+        return fd;
+    }
+}
+
+// Write all of [iov, iov + count) to the channel. The iovecs are modified.
+// Returns the number of system calls made, which is zero unless one end had
+// to sleep.
+inline std::size_t gather_write(shm_channel* c, iovec* iov, std::size_t count)
+{
+    std::size_t syscalls = 0;
+
+    while (count > 0)
+    {
+        std::size_t const n = detail::shm_write_some(*c, iov, count, syscalls);
+        detail::consume_iovecs(iov, count, n);
+    }
+
+    return syscalls;
+}
+
+// Fill all of [iov, iov + count) from the channel. The iovecs are modified.
+// Returns the number of system calls made.
+inline std::size_t scatter_read(shm_channel* c, iovec* iov, std::size_t count)
+{
+    std::size_t syscalls = 0;
+
+    while (count > 0)
+    {
+        std::size_t const n = detail::shm_read_some(*c, iov, count, syscalls);
+        detail::consume_iovecs(iov, count, n);
+    }
+
+    return syscalls;
+}
+
+// Close the channel under a stripe worker (see stripe_workers), so that its
+// transfer fails instead of waiting for the peer.
+inline void shutdown_stripe(shm_channel* c)
+{
+    std::size_t syscalls = 0;
+    detail::shm_close(*c->region, syscalls);
+}
+
+// Read at least min and at most size bytes from the channel into data.
+// Returns the number of bytes read; syscalls is incremented for each system
+// call.
+inline std::size_t read_at_least(
+    shm_channel* c
+  , char* data
+  , std::size_t size
+  , std::size_t min
+  , std::size_t& syscalls
+    )
+{
+    std::size_t bytes = 0;
+
+    while (bytes < min)
+    {
+        iovec v = { data + bytes, size - bytes };
+        bytes += detail::shm_read_some(*c, &v, 1, syscalls);
+    }
+
+    return bytes;
+}
+
+// This process's mapping of a region, and the heap in it. The stream holds on
+// to it, and so does every shm_allocator of the heap; the region is unmapped
+// when the last of them lets go.
+struct shm_heap
+  : boost::enable_shared_from_this<shm_heap>
+  , boost::noncopyable
+{
+    BOOST_STATIC_CONSTANT(std::size_t, npos = std::size_t(-1));
+
+  private:
+    shm_region* region_;
+    std::size_t mapping_size_;
+    char* pages_;
+    std::size_t page_count_;
+
+    // Both ends allocate and free, so the lock is in the region. It is only
+    // held for a scan of the bitmap, so waiting for it spins.
+    struct heap_lock
+    {
+        std::atomic<boost::uint32_t>& lock;
+
+        explicit heap_lock(std::atomic<boost::uint32_t>& l)
+          : lock(l)
+        {
+            while (0 != lock.exchange(1, std::memory_order_acquire))
+                ::sched_yield();
+        }
+
+        ~heap_lock()
+        {
+            lock.store(0, std::memory_order_release);
+        }
+    };
+
+  public:
+    shm_heap(shm_region* region, std::size_t mapping_size)
+      : region_(region)
+      , mapping_size_(mapping_size)
+      , pages_(region->heap())
+      , page_count_(std::size_t(region->heap_pages))
+    {}
+
+    ~shm_heap()
+    {
+        ::munmap(region_, mapping_size_);
+    }
+
+    shm_region* region() const
+    {
+        return region_;
+    }
+
+    std::size_t size() const
+    {
+        return page_count_ * shm_region::page_size;
+    }
+
+    bool contains(void const* p) const
+    {
+        char const* const c = static_cast<char const*>(p);
+        return c >= pages_ && c < pages_ + size();
+    }
+
+    boost::uint64_t offset(void const* p) const
+    {
+        return boost::uint64_t(static_cast<char const*>(p) - pages_);
+    }
+
+    // A block of at least n bytes, holding one reference, or 0 if there is no
+    // room for it.
+    void* allocate(std::size_t n)
+    {
+        if (0 == n || n > size())
+            return 0;
+
+        std::size_t const count
+            = (n + shm_region::page_size - 1) / shm_region::page_size;
+
+        heap_lock l(region_->heap_lock);
+
+        std::size_t first = find_free(std::size_t(region_->heap_hint), count);
+        if (npos == first)
+            first = find_free(0, count);
+        if (npos == first)
+            return 0;
+
+        boost::uint64_t* const bitmap = region_->heap_bitmap();
+        for (std::size_t i = first; i < first + count; ++i)
+            bitmap[i / 64] |= boost::uint64_t(1) << (i % 64);
+
+        shm_block& b = region_->heap_blocks()[first];
+        b.pages = boost::uint32_t(count);
+        b.references.store(1);
+
+        region_->heap_hint = first + count;
+
+        return pages_ + first * shm_region::page_size;
+    }
+
+    // Take another reference to the block at offset.
+    void retain(boost::uint64_t offset)
+    {
+        region_->heap_blocks()[offset / shm_region::page_size]
+            .references.fetch_add(1);
+    }
+
+    // Drop a reference to the block at p, and free it with the last one.
+    void release(void const* p)
+    {
+        std::size_t const first
+            = std::size_t(offset(p) / shm_region::page_size);
+
+        shm_block& b = region_->heap_blocks()[first];
+
+        if (1 != b.references.fetch_sub(1))
+            return;
+
+        heap_lock l(region_->heap_lock);
+
+        boost::uint64_t* const bitmap = region_->heap_bitmap();
+        for (std::size_t i = first; i < first + b.pages; ++i)
+            bitmap[i / 64] &= ~(boost::uint64_t(1) << (i % 64));
+
+        b.pages = 0;
+    }
+
+    // The block at offset, if one in use starts there and holds n bytes;
+    // otherwise 0. Offsets come from the peer, so they are checked.
+    void* block(boost::uint64_t offset, boost::uint64_t n) const
+    {
+        if (0 != offset % shm_region::page_size || offset >= size())
+            return 0;
+
+        shm_block const& b
+            = region_->heap_blocks()[offset / shm_region::page_size];
+
+        if (   0 == b.references.load()
+            || n > boost::uint64_t(b.pages) * shm_region::page_size
+            || n > size() - offset)
+            return 0;
+
+        return pages_ + offset;
+    }
+
+  private:
+    // The first run of count free pages at or after page from, or npos.
+    std::size_t find_free(std::size_t from, std::size_t count) const
+    {
+        boost::uint64_t const* const bitmap = region_->heap_bitmap();
+
+        std::size_t run = 0;
+
+        for (std::size_t i = from; i < page_count_; )
+        {
+            // Skip whole words of pages in use.
+            if (0 == i % 64 && ~boost::uint64_t(0) == bitmap[i / 64])
+            {
+                run = 0;
+                i += 64;
+                continue;
+            }
+
+            if (0 != (bitmap[i / 64] & (boost::uint64_t(1) << (i % 64))))
+                run = 0;
+            else if (++run == count)
+                return i + 1 - count;
+
+            ++i;
+        }
+
+        return npos;
+    }
+};
+
+namespace detail
+{
+    // A block that the next shm_allocator::allocate() on this thread returns
+    // instead of allocating one (see adopt_block()).
+    inline void*& shm_adopted_block()
+    {
+        static thread_local void* block = 0;
+        return block;
+    }
+}
+
+// An allocator for vectors that are handed off to the peer instead of being
+// sent: std::vector<double, shm_allocator<double> >. Storage comes from the
+// shared heap of a connection, or from operator new if there is no heap or no
+// room in it; such vectors are sent as usual. Like default_init_allocator, it
+// leaves the elements a vector creates without a value uninitialized, so that
+// adopting a block doesn't overwrite what the sender put in it.
+template <typename T>
+struct shm_allocator
+{
+    typedef T value_type;
+
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef shm_allocator<U> other;
+    };
+
+    boost::shared_ptr<shm_heap> heap;
+
+    shm_allocator()
+      : heap()
+    {}
+
+    explicit shm_allocator(boost::shared_ptr<shm_heap> const& h)
+      : heap(h)
+    {}
+
+    template <typename U>
+    shm_allocator(shm_allocator<U> const& a)
+      : heap(a.heap)
+    {}
+
+    T* allocate(std::size_t n)
+    {
+        void*& adopted = detail::shm_adopted_block();
+
+        if (0 != adopted)
+        {
+            void* const p = adopted;
+            adopted = 0;
+            return static_cast<T*>(p);
+        }
+
+        if (heap)
+        {
+            if (void* p = heap->allocate(n * sizeof(T)))
+                return static_cast<T*>(p);
+        }
+
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+        if (heap && heap->contains(p))
+            heap->release(p);
+        else
+            ::operator delete(p);
+    }
+
+    template <typename U>
+    void construct(U* p)
+    {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(shm_allocator<T> const& a, shm_allocator<U> const& b)
+{
+    return a.heap == b.heap;
+}
+
+template <typename T, typename U>
+bool operator!=(shm_allocator<T> const& a, shm_allocator<U> const& b)
+{
+    return a.heap != b.heap;
+}
+
+// The hand off of vectors by the archives (see zero_copy_archive.hpp). Is
+// [data, data + n) a block of the heap of the channel? If so, offset is where
+// it is in the heap.
+template <typename T>
+inline bool shared_block(
+    shm_channel* c
+  , shm_allocator<T> const& a
+  , void const* data
+  , std::size_t n
+  , boost::uint64_t& offset
+    )
+{
+    if (   !a.heap
+        || a.heap.get() != c->heap
+        || !a.heap->contains(data))
+        return false;
+
+    offset = a.heap->offset(data);
+    return 0 != a.heap->block(offset, n);
+}
+
+// Take a reference to the block at offset for the peer, which adopts it.
+inline void share_block(shm_channel* c, boost::uint64_t offset)
+{
+    c->heap->retain(offset);
+}
+
+// Make the block at offset, which holds elements Ts, the storage of v. Returns
+// false if there is no such block.
+template <typename T>
+inline bool adopt_block(
+    shm_channel* c
+  , std::vector<T, shm_allocator<T> >& v
+  , std::size_t elements
+  , boost::uint64_t offset
+    )
+{
+    if (   0 == elements
+        || elements > std::numeric_limits<std::size_t>::max() / sizeof(T))
+        return false;
+
+    void* const p = c->heap->block(offset, elements * sizeof(T));
+
+    if (0 == p)
+        return false;
+
+    std::vector<T, shm_allocator<T> > adopted(
+        shm_allocator<T>(c->heap->shared_from_this()));
+
+    // reserve() allocates exactly elements Ts, which the allocator takes from
+    // the block; resize() then leaves them as the sender wrote them.
+    detail::shm_adopted_block() = p;
+    adopted.reserve(elements);
+    BOOST_ASSERT(0 == detail::shm_adopted_block());
+    adopted.resize(elements);
+
+    v.swap(adopted);
+    return true;
+}
+
+// A connection to a peer on the same host, through shared memory. It is set
+// up like a socket: connect() it, or accept() it with a shm_acceptor. Socket
+// options apply to the UNIX domain socket the region is handed over with.
+struct shm_stream : boost::asio::socket_base, boost::noncopyable
+{
+    typedef shm_channel* native_handle_type;
+
+    BOOST_STATIC_CONSTANT(std::size_t, default_ring_size = 4 << 20);
+
+  private:
+    friend struct shm_acceptor;
+
+    boost::asio::local::stream_protocol::socket control_;
+    std::size_t ring_size_;
+    std::size_t heap_pages_;
+
+    shm_region* region_;
+    boost::shared_ptr<shm_heap> heap_; ///< Owns the mapping of region_.
+    shm_channel channel_;
+
+  public:
+    explicit shm_stream(boost::asio::io_service& io_service)
+      : control_(io_service)
+      , ring_size_(default_ring_size)
+      , heap_pages_(0)
+      , region_(0)
+      , heap_()
+      , channel_()
+    {}
+
+    ~shm_stream()
+    {
+        boost::system::error_code ec;
+        close(ec);
+    }
+
+    // Bytes in each direction of the connections this end creates; rounded
+    // up to a power of two. The accepting end takes what it is handed.
+    std::size_t ring_size() const
+    {
+        return ring_size_;
+    }
+
+    void ring_size(std::size_t n)
+    {
+        // No power of two of size_t is that large.
+        if (n > (std::numeric_limits<std::size_t>::max() >> 1) + 1)
+            throw boost::system::system_error(
+                boost::asio::error::invalid_argument);
+
+        ring_size_ = 4096;
+        while (ring_size_ < n)
+            ring_size_ <<= 1;
+    }
+
+    // Bytes of the shared heap of the connections this end creates (see
+    // shm_allocator); rounded up to whole pages. 0, the default, leaves it
+    // out. The accepting end takes what it is handed.
+    std::size_t heap_size() const
+    {
+        return heap_pages_ * shm_region::page_size;
+    }
+
+    void heap_size(std::size_t n)
+    {
+        std::size_t const pages = n / shm_region::page_size
+                                + (0 != n % shm_region::page_size);
+
+        // shm_block counts pages in 32 bits.
+        if (pages > 0xffffffff)
+            throw boost::system::system_error(
+                boost::asio::error::invalid_argument);
+
+        heap_pages_ = pages;
+    }
+
+    // The heap of the connection, for shm_allocator; null while the stream
+    // isn't connected.
+    boost::shared_ptr<shm_heap> const& heap() const
+    {
+        return heap_;
+    }
+
+    template <typename Option>
+    void set_option(Option const& o)
+    {
+        control_.set_option(o);
+    }
+
+    // Connect to a shm_acceptor listening on e, and hand it a new region.
+    void connect(boost::asio::local::stream_protocol::endpoint const& e)
+    {
+        control_.connect(e);
+
+        std::size_t const size
+            = shm_region::mapping_size(ring_size_, heap_pages_);
+        int const fd = detail::shm_create(size);
+
+        try
+        {
+            map(fd, size, true);
+            detail::send_fd(control_.native_handle(), fd);
+        }
+
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        ::close(fd);
+    }
+
+    native_handle_type native_handle()
+    {
+        return &channel_;
+    }
+
+    bool is_open() const
+    {
+        return 0 != region_;
+    }
+
+    // Closing either end closes both directions; the peer's pending reads
+    // drain the ring, then fail with eof.
+    void close(boost::system::error_code& ec)
+    {
+        if (0 != region_)
+        {
+            std::size_t syscalls = 0;
+
+            detail::shm_close(*region_, syscalls);
+
+            heap_.reset();
+            region_ = 0;
+            channel_ = shm_channel();
+        }
+
+        control_.close(ec);
+    }
+
+    void close()
+    {
+        boost::system::error_code ec;
+        close(ec);
+        if (ec)
+            throw boost::system::system_error(ec);
+    }
+
+    template <typename MutableBufferSequence>
+    std::size_t read_some(
+        MutableBufferSequence const& buffers
+      , boost::system::error_code& ec
+        )
+    {
+        std::vector<iovec> iovs;
+        append_iovecs(buffers, iovs);
+
+        if (0 == region_)
+        {
+            ec = boost::asio::error::not_connected;
+            return 0;
+        }
+
+        ec = boost::system::error_code();
+
+        if (iovs.empty())
+            return 0;
+
+        try
+        {
+            std::size_t syscalls = 0;
+            return detail::shm_read_some(channel_, &iovs[0], iovs.size()
+                                       , syscalls);
+        }
+
+        catch (boost::system::system_error const& e)
+        {
+            ec = e.code();
+            return 0;
+        }
+    }
+
+    template <typename MutableBufferSequence>
+    std::size_t read_some(MutableBufferSequence const& buffers)
+    {
+        boost::system::error_code ec;
+        std::size_t const n = read_some(buffers, ec);
+        if (ec)
+            throw boost::system::system_error(ec);
+        return n;
+    }
+
+    template <typename ConstBufferSequence>
+    std::size_t write_some(
+        ConstBufferSequence const& buffers
+      , boost::system::error_code& ec
+        )
+    {
+        std::vector<iovec> iovs;
+        append_iovecs(buffers, iovs);
+
+        if (0 == region_)
+        {
+            ec = boost::asio::error::not_connected;
+            return 0;
+        }
+
+        ec = boost::system::error_code();
+
+        if (iovs.empty())
+            return 0;
+
+        try
+        {
+            std::size_t syscalls = 0;
+            return detail::shm_write_some(channel_, &iovs[0], iovs.size()
+                                        , syscalls);
+        }
+
+        catch (boost::system::system_error const& e)
+        {
+            ec = e.code();
+            return 0;
+        }
+    }
+
+    template <typename ConstBufferSequence>
+    std::size_t write_some(ConstBufferSequence const& buffers)
+    {
+        boost::system::error_code ec;
+        std::size_t const n = write_some(buffers, ec);
+        if (ec)
+            throw boost::system::system_error(ec);
+        return n;
+    }
+
+  private:
+    void map(int fd, std::size_t size, bool connecting)
+    {
+        void* p = ::mmap(0, size, PROT_READ | PROT_WRITE
+                       , MAP_SHARED | MAP_POPULATE, fd, 0);
+
+        if (MAP_FAILED == p)
+            detail::throw_errno();
+
+        shm_region* region = static_cast<shm_region*>(p);
+
+        if (connecting)
+        {
+            new (region) shm_region(ring_size_, heap_pages_);
+            new (region->ring(0)) shm_ring();
+            new (region->ring(1)) shm_ring();
+        }
+
+        // The sizes are checked before mapping_size() is trusted with them.
+        else if (  size < sizeof(shm_region)
+                || shm_region::magic_value != region->magic
+                || 0 == region->ring_size
+                || 0 != (region->ring_size & (region->ring_size - 1))
+                || region->ring_size > size
+                || region->heap_pages > size / shm_region::page_size
+                || size != shm_region::mapping_size(
+                       std::size_t(region->ring_size)
+                     , std::size_t(region->heap_pages)))
+        {
+            ::munmap(p, size);
+            throw boost::system::system_error(
+                boost::asio::error::invalid_argument);
+        }
+
+        region_ = region;
+        heap_.reset(new shm_heap(region, size));
+
+        std::size_t const out = connecting ? 0 : 1;
+
+        channel_.region = region;
+        channel_.heap = heap_.get();
+        channel_.out = region->ring(out);
+        channel_.out_data = region->ring_data(out);
+        channel_.in = region->ring(1 - out);
+        channel_.in_data = region->ring_data(1 - out);
+        channel_.capacity = std::size_t(region->ring_size);
+        channel_.control = control_.native_handle();
+    }
+};
+
+struct shm_acceptor : boost::asio::socket_base, boost::noncopyable
+{
+  private:
+    boost::asio::local::stream_protocol::acceptor control_;
+
+  public:
+    shm_acceptor(
+        boost::asio::io_service& io_service
+      , boost::asio::local::stream_protocol::endpoint const& e
+        )
+      : control_(io_service, e)
+    {}
+
+    template <typename Option>
+    void set_option(Option const& o)
+    {
+        control_.set_option(o);
+    }
+
+    // Wait for a shm_stream to connect, and take over its region.
+    void accept(shm_stream& s)
+    {
+        control_.accept(s.control_);
+
+        int const fd = detail::receive_fd(s.control_.native_handle());
+
+        struct stat st;
+
+        if (::fstat(fd, &st) < 0)
+        {
+            ::close(fd);
+            detail::throw_errno();
+        }
+
+        try
+        {
+            s.map(fd, std::size_t(st.st_size), false);
+        }
+
+        catch (...)
+        {
+            ::close(fd);
+            throw;
+        }
+
+        ::close(fd);
+    }
+};
+
+// The shared-memory transport, in the shape of an Asio protocol; peers find
+// each other through the path of a UNIX domain socket.
+struct shm_protocol
+{
+    typedef boost::asio::local::stream_protocol::endpoint endpoint;
+    typedef shm_stream socket;
+    typedef shm_acceptor acceptor;
+};
+
+#endif
+
@@ -0,0 +1,42 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z57D91CEC_0C57_4FDD_A7F7_B23CB1AAAF9A)
+#define Z57D91CEC_0C57_4FDD_A7F7_B23CB1AAAF9A
+
+#include <boost/asio.hpp>
+#include <boost/system/error_code.hpp>
+
+// The archives are templated on the stream they talk over. Besides being an
+// Asio SyncReadStream/SyncWriteStream with async_read_some() and
+// async_write_some(), a stream has to expose its file descriptor through
+// native_handle(): the zero-copy archives move message bodies with readv and
+// writev on it directly (see scatter_gather_io.hpp). TCP and UNIX domain
+// sockets qualify, and so do pipes wrapped in posix::stream_descriptor. A
+// stream whose native handle is something else has to come with its own
+// gather_write(), scatter_read() and read_at_least() overloads for it, like
+// shm_stream (see shm_transport.hpp).
+
+// Close a stream that is not a socket.
+template <typename Stream>
+inline void close_stream(Stream& s)
+{
+    boost::system::error_code ec;
+    s.close(ec);
+}
+
+// Gracefully and portably shutdown a socket, then close it.
+template <typename Protocol, typename Service>
+inline void close_stream(
+    boost::asio::basic_stream_socket<Protocol, Service>& s
+    )
+{
+    boost::system::error_code ec;
+    s.shutdown(boost::asio::socket_base::shutdown_both, ec);
+    s.close(ec);
+}
+
+#endif
+
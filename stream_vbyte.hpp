@@ -0,0 +1,192 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z6A1C9E34_B27F_4D58_8E03_5F94D2B7A6C1)
+#define Z6A1C9E34_B27F_4D58_8E03_5F94D2B7A6C1
+
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/detail/endian.hpp>
+#include <boost/type_traits/is_signed.hpp>
+
+#include <cstddef>
+#include <algorithm>
+
+#if defined(__SSSE3__) && !defined(BOOST_BIG_ENDIAN)
+    #include <tmmintrin.h>
+    #define ZERO_COPY_STREAM_VBYTE_SSSE3
+#endif
+
+#include "portable_binary_archive.hpp"
+
+// Stream VByte encoding of integers of up to 32 bits, used by the portable
+// archives for integer arrays when integer_stream_vbyte is set. A block of up
+// to stream_vbyte_block integers is stored as one control byte per four
+// integers, holding the byte length (1 to 4) of each of them in two bits,
+// followed by the data bytes of all integers, little endian. Signed values
+// are zigzag encoded first. Because the lengths are separate from the data,
+// four integers can be decoded at once with a single byte shuffle picked
+// from a table by their control byte.
+
+const std::size_t stream_vbyte_block = 64;
+
+// Control bytes of a full block.
+const std::size_t stream_vbyte_control_size = stream_vbyte_block / 4;
+
+// The decoder reads up to this many bytes past the end of the data.
+const std::size_t stream_vbyte_padding = 16;
+
+namespace detail
+{
+    struct stream_vbyte_tables
+    {
+        unsigned char lengths[256]; ///< Data bytes of the four integers.
+        char shuffles[256][16];     ///< Spreads them over four 32-bit lanes.
+
+        stream_vbyte_tables()
+        {
+            for (std::size_t c = 0; c < 256; ++c)
+            {
+                std::size_t offset = 0;
+
+                for (std::size_t i = 0; i < 4; ++i)
+                {
+                    std::size_t const length = ((c >> (2 * i)) & 3) + 1;
+
+                    for (std::size_t b = 0; b < 4; ++b)
+                        shuffles[c][4 * i + b] = (b < length)
+                            ? char(offset + b) : char(0x80);
+
+                    offset += length;
+                }
+
+                lengths[c] = (unsigned char)(offset);
+            }
+        }
+    };
+
+    inline stream_vbyte_tables const& stream_vbyte_table()
+    {
+        static stream_vbyte_tables const tables;
+        return tables;
+    }
+
+    inline std::size_t stream_vbyte_length(boost::uint32_t v)
+    {
+        return (v < (1u << 8)) ? 1
+             : (v < (1u << 16)) ? 2
+             : (v < (1u << 24)) ? 3 : 4;
+    }
+}
+
+// Number of data bytes that follow the control bytes of count integers.
+inline std::size_t stream_vbyte_data_size(
+    unsigned char const* control
+  , std::size_t count
+    )
+{
+    detail::stream_vbyte_tables const& tables = detail::stream_vbyte_table();
+
+    std::size_t size = 0;
+    std::size_t i = 0;
+
+    for (; i + 4 <= count; i += 4)
+        size += tables.lengths[control[i / 4]];
+
+    for (; i < count; ++i)
+        size += ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+
+    return size;
+}
+
+// Encode count (at most stream_vbyte_block) integers into out, which must hold
+// stream_vbyte_control_size + 4 * count bytes. Returns the number of bytes
+// used.
+template <typename T>
+std::size_t stream_vbyte_encode(
+    T const* in
+  , std::size_t count
+  , unsigned char* out
+    )
+{
+    BOOST_ASSERT(count <= stream_vbyte_block);
+
+    typedef typename boost::is_signed<T>::type is_signed;
+
+    std::size_t const control_size = (count + 3) / 4;
+
+    unsigned char* control = out;
+    unsigned char* data = out + control_size;
+
+    std::fill(control, data, 0);
+
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        boost::uint32_t const v
+            = boost::uint32_t(compact_zigzag(in[i], is_signed()));
+        std::size_t const length = detail::stream_vbyte_length(v);
+
+        control[i / 4] |= (unsigned char)((length - 1) << (2 * (i % 4)));
+
+        for (std::size_t b = 0; b < length; ++b)
+            *data++ = (unsigned char)(v >> (8 * b));
+    }
+
+    return std::size_t(data - out);
+}
+
+// Decode count integers. data has to be readable for stream_vbyte_padding
+// bytes past its end.
+template <typename T>
+void stream_vbyte_decode(
+    unsigned char const* control
+  , unsigned char const* data
+  , std::size_t count
+  , T* out
+    )
+{
+    BOOST_ASSERT(count <= stream_vbyte_block);
+
+    typedef typename boost::is_signed<T>::type is_signed;
+
+    boost::uint32_t values[stream_vbyte_block];
+
+    std::size_t i = 0;
+
+#if defined(ZERO_COPY_STREAM_VBYTE_SSSE3)
+    detail::stream_vbyte_tables const& tables = detail::stream_vbyte_table();
+
+    for (; i + 4 <= count; i += 4)
+    {
+        unsigned char const c = control[i / 4];
+
+        __m128i const shuffle = _mm_loadu_si128(
+            reinterpret_cast<__m128i const*>(tables.shuffles[c]));
+        __m128i const v = _mm_loadu_si128(
+            reinterpret_cast<__m128i const*>(data));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i)
+                       , _mm_shuffle_epi8(v, shuffle));
+
+        data += tables.lengths[c];
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        std::size_t const length = ((control[i / 4] >> (2 * (i % 4))) & 3) + 1;
+
+        boost::uint32_t v = 0;
+        for (std::size_t b = 0; b < length; ++b)
+            v |= boost::uint32_t(*data++) << (8 * b);
+
+        values[i] = v;
+    }
+
+    for (i = 0; i < count; ++i)
+        out[i] = compact_unzigzag<T>(values[i], is_signed());
+}
+
+#endif
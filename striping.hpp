@@ -0,0 +1,342 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z5B2E8D14_7A3F_4C69_8E1B_C04F6A92D3E7)
+#define Z5B2E8D14_7A3F_4C69_8E1B_C04F6A92D3E7
+
+#include <boost/assert.hpp>
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <cstddef>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Striping of large chunks over several connections to the same peer. The
+// sender picks byte ranges of the message body (its large chunks) and cuts
+// them into stripes of a fixed size, which are dealt out to the stripe
+// connections in turn. The rest of the body goes over the main connection as
+// usual. Both ends cut their own buffer lists the same way, so every stripe
+// lands where it belongs without being copied.
+
+// A striped range of the message body.
+struct stripe_range
+{
+    std::size_t offset; ///< From the start of the body.
+    std::size_t length;
+};
+
+namespace detail
+{
+    inline void append_stripe(
+        std::vector<iovec>& iovs
+      , char* data
+      , std::size_t n
+        )
+    {
+        if (!iovs.empty())
+        {
+            iovec& last = iovs.back();
+
+            if (static_cast<char*>(last.iov_base) + last.iov_len == data)
+            {
+                last.iov_len += n;
+                return;
+            }
+        }
+
+        iovec v = { data, n };
+        iovs.push_back(v);
+    }
+}
+
+// Move the stripes of ranges (sorted by offset) from the iovec array iovs to
+// stripes, which has one iovec array per stripe connection. The body starts at
+// iovs[first]; the iovecs before it are left alone. Stripe k of all ranges,
+// counted from the first, goes to stripes[k % stripes.size()].
+inline void split_stripes(
+    std::vector<iovec>& iovs
+  , std::size_t first
+  , std::vector<stripe_range> const& ranges
+  , std::size_t stripe_size
+  , std::vector<std::vector<iovec> >& stripes
+    )
+{
+    for (std::size_t s = 0; s < stripes.size(); ++s)
+        stripes[s].clear();
+
+    if (ranges.empty() || stripes.empty())
+        return;
+
+    // Number of the first stripe of each range.
+    std::vector<std::size_t> first_stripe(ranges.size());
+    for (std::size_t r = 0, k = 0; r < ranges.size(); ++r)
+    {
+        first_stripe[r] = k;
+        k += (ranges[r].length + stripe_size - 1) / stripe_size;
+    }
+
+    std::vector<iovec> rest(iovs.begin(), iovs.begin() + first);
+
+    std::size_t offset = 0; ///< Body offset of iovs[i].
+    std::size_t r = 0;
+
+    for (std::size_t i = first; i < iovs.size(); ++i)
+    {
+        char* const base = static_cast<char*>(iovs[i].iov_base);
+        std::size_t const size = iovs[i].iov_len;
+
+        std::size_t pos = 0;
+
+        while (pos < size)
+        {
+            std::size_t const at = offset + pos;
+
+            while (   r < ranges.size()
+                   && ranges[r].offset + ranges[r].length <= at)
+                ++r;
+
+            // Not striped, up to the next range.
+            if (r == ranges.size() || ranges[r].offset > at)
+            {
+                std::size_t n = size - pos;
+
+                if (r < ranges.size())
+                    n = (std::min)(n, ranges[r].offset - at);
+
+                detail::append_stripe(rest, base + pos, n);
+                pos += n;
+                continue;
+            }
+
+            // Striped, up to the end of the current stripe.
+            std::size_t const in_range = at - ranges[r].offset;
+            std::size_t const stripe = in_range / stripe_size;
+            std::size_t const stripe_end = (std::min)(
+                (stripe + 1) * stripe_size, ranges[r].length);
+            std::size_t const n = (std::min)(size - pos, stripe_end - in_range);
+
+            detail::append_stripe(
+                stripes[(first_stripe[r] + stripe) % stripes.size()]
+              , base + pos, n);
+            pos += n;
+        }
+
+        offset += size;
+    }
+
+    iovs.swap(rest);
+}
+
+// Make the transfers under way on the stripe connection fd fail, so that its
+// worker returns. Handles of other kinds come with their own overload, found by
+// argument dependent lookup (see shm_transport.hpp).
+inline void shutdown_stripe(int fd)
+{
+    ::shutdown(fd, SHUT_RDWR);
+}
+
+// One thread per stripe connection, kept for as long as the connections are
+// used, that moves the stripes of each message over its connection. Handle is
+// the native handle of the connections (a file descriptor for sockets).
+template <typename Handle>
+class stripe_workers
+{
+    struct worker
+    {
+        Handle handle;
+        iovec* iov;
+        std::size_t count;
+        std::size_t syscalls;
+        std::exception_ptr error;
+        bool busy; ///< Has a transfer to do, or is doing it.
+        std::thread thread;
+    };
+
+    std::function<std::size_t(Handle, iovec*, std::size_t)> transfer_;
+    std::deque<worker> workers_;
+    std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable done_;
+    std::size_t pending_;
+    bool stopping_;
+
+  public:
+    stripe_workers()
+      : transfer_()
+      , workers_()
+      , mutex_()
+      , work_()
+      , done_()
+      , pending_(0)
+      , stopping_(false)
+    {}
+
+    ~stripe_workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+
+        work_.notify_all();
+
+        for (std::size_t s = 0; s < workers_.size(); ++s)
+            workers_[s].thread.join();
+    }
+
+    // Start the worker of the next stripe connection.
+    void add(Handle h)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        workers_.push_back(worker());
+
+        worker& w = workers_.back();
+        w.handle = h;
+        w.iov = 0;
+        w.count = 0;
+        w.syscalls = 0;
+        w.busy = false;
+        w.thread = std::thread(&stripe_workers::run, this, &w);
+    }
+
+    std::size_t size() const
+    {
+        return workers_.size();
+    }
+
+    // Transfer stripes[s] over connection s on its worker, while
+    // [iov, iov + count) is transferred over h on the calling thread. op is
+    // called as op(handle, iov, count), like gather_write() or scatter_read()
+    // (see gather_writer and scatter_reader). The first exception thrown by
+    // any of them is rethrown once all are done; if the one on the calling
+    // thread throws, the stripe connections still in use are shut down (see
+    // shutdown_stripe()) rather than waited on, as their peer may never get
+    // to them. Returns the number of system calls made.
+    template <typename Transfer>
+    std::size_t transfer(
+        Transfer const& op
+      , Handle h
+      , iovec* iov
+      , std::size_t count
+      , std::vector<std::vector<iovec> >& stripes
+        )
+    {
+        BOOST_ASSERT(stripes.size() <= workers_.size());
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            transfer_ = op;
+
+            for (std::size_t s = 0; s < stripes.size(); ++s)
+            {
+                if (stripes[s].empty())
+                    continue;
+
+                worker& w = workers_[s];
+                w.iov = &stripes[s][0];
+                w.count = stripes[s].size();
+                w.syscalls = 0;
+                w.busy = true;
+                ++pending_;
+            }
+        }
+
+        work_.notify_all();
+
+        std::size_t total = 0;
+        std::exception_ptr error;
+
+        if (0 != count)
+        {
+            try
+            {
+                total += op(h, iov, count);
+            }
+
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (error)
+        {
+            for (std::size_t s = 0; s < workers_.size(); ++s)
+                if (workers_[s].busy)
+                    shutdown_stripe(workers_[s].handle);
+        }
+
+        while (0 != pending_)
+            done_.wait(lock);
+
+        for (std::size_t s = 0; s < workers_.size(); ++s)
+        {
+            worker& w = workers_[s];
+
+            total += w.syscalls;
+            w.syscalls = 0;
+
+            if (w.error && !error)
+                error = w.error;
+            w.error = std::exception_ptr();
+        }
+
+        lock.unlock();
+
+        if (error)
+            std::rethrow_exception(error);
+
+        return total;
+    }
+
+  private:
+    void run(worker* w)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        for (;;)
+        {
+            while (!stopping_ && !w->busy)
+                work_.wait(lock);
+
+            if (stopping_)
+                return;
+
+            lock.unlock();
+
+            try
+            {
+                w->syscalls = transfer_(w->handle, w->iov, w->count);
+            }
+
+            catch (...)
+            {
+                w->error = std::current_exception();
+            }
+
+            lock.lock();
+
+            w->busy = false;
+
+            if (0 == --pending_)
+                done_.notify_all();
+        }
+    }
+};
+
+#endif
+
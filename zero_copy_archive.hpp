@@ -9,28 +9,202 @@
 #include <boost/ref.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
-#include <boost/iostreams/stream.hpp>
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
 #include <boost/serialization/serialization.hpp>
 #include <boost/serialization/access.hpp>
 #include <boost/serialization/vector.hpp>
+#include <boost/serialization/nvp.hpp>
+#include <boost/serialization/version.hpp>
+#include <boost/serialization/is_bitwise_serializable.hpp>
+#include <boost/archive/basic_archive.hpp>
+#include <boost/archive/archive_exception.hpp>
+#include <boost/throw_exception.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/type_traits/is_arithmetic.hpp>
+#include <boost/type_traits/is_class.hpp>
+#include <boost/type_traits/is_final.hpp>
+#include <boost/type_traits/detail/yes_no_type.hpp>
 
 #include <vector>
-
-#include "container_device.hpp"
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <cstring>
+
+#include "direct_streambuf.hpp"
+#include "default_init_allocator.hpp"
+#include "zero_copy_arena.hpp"
+#include "scatter_gather_io.hpp"
+#include "byte_swap.hpp"
+#include "striping.hpp"
+#include "chunk_codec.hpp"
+#include "crc32c.hpp"
+#include "homogeneity_handshake.hpp"
+#include "stream_transport.hpp"
 
 #include "portable_binary_iarchive.hpp"
 #include "portable_binary_oarchive.hpp"
 
-// NOTE: Not using the actual Boost.Endian code to avoid copying more stuff
-// over to this git repository.
-namespace boost { namespace integer { typedef boost::uint64_t ulittle64_t; }}
+// Every zero-copy message starts with this fixed-size prelude. The first few
+// chunk sizes are stored inline, so for most parcels the receiver can pick up
+// the prelude, the whole size table and the leading scalars of the body with a
+// single read. Chunk sizes that don't fit inline follow the prelude directly.
+struct zero_copy_prelude
+{
+    BOOST_STATIC_CONSTANT(std::size_t, inline_chunks = 5);
+
+    // Flags.
+    BOOST_STATIC_CONSTANT(boost::uint64_t, slow_segment = 1);
+    BOOST_STATIC_CONSTANT(boost::uint64_t, rendezvous = 2); ///< The body
+        ///< follows once the receiver has sent a clear_to_send frame.
+    BOOST_STATIC_CONSTANT(boost::uint64_t, checksum = 4); ///< The body ends
+        ///< with the CRC32C of the rest of it, as a 64-bit word.
+    BOOST_STATIC_CONSTANT(boost::uint64_t, clear_to_send = 8); ///< Sent back
+        ///< by the receiver of a rendezvous message once it has laid out the
+        ///< parcel. It has no size table and no body; body_size and the
+        ///< channel echo the announcement.
+
+    // Bits 8 to 31 of the flags are the number of striped ranges of the
+    // body. If there are any, the size table ends with the stripe size, the
+    // number of stripe connections and the offset and length of each range.
+    BOOST_STATIC_CONSTANT(std::size_t, stripe_ranges_shift = 8);
+    BOOST_STATIC_CONSTANT(boost::uint64_t, stripe_ranges_mask = 0xffffff);
+
+    // The upper half of the flags is the channel of the message.
+    BOOST_STATIC_CONSTANT(std::size_t, channel_shift = 32);
+
+    // The top byte of the size entry of a bitwise vector is the id of the
+    // chunk_codec its bytes were encoded with. If it isn't 0, the next entry
+    // is the encoded size. handoff marks a vector whose bytes aren't in the
+    // body at all: the next entry is the offset of the block they are in, in
+    // memory shared with the peer (see adopt_block()).
+    BOOST_STATIC_CONSTANT(std::size_t, codec_shift = 56);
+    BOOST_STATIC_CONSTANT(boost::uint8_t, handoff = 255);
+    BOOST_STATIC_CONSTANT(boost::uint64_t, elements_mask
+                                         = (boost::uint64_t(1) << 56) - 1);
+
+    boost::integer::ulittle64_t flags;
+    boost::integer::ulittle64_t chunks;    ///< Number of chunk sizes.
+    boost::integer::ulittle64_t body_size; ///< Bytes following the size table.
+    boost::integer::ulittle64_t chunk_sizes[inline_chunks];
+};
+
+// The prelude and the chunk size table are little endian on the wire.
+inline void to_wire_order(boost::integer::ulittle64_t* data, std::size_t n)
+{
+#if defined(BOOST_BIG_ENDIAN)
+    byte_swap_inplace(data, n);
+#else
+    (void)data;
+    (void)n;
+#endif
+}
+
+inline void to_wire_order(zero_copy_prelude& p)
+{
+    to_wire_order(&p.flags, sizeof(p) / sizeof(boost::integer::ulittle64_t));
+}
+
+// The clear_to_send frame for a rendezvous message announced by p. Both are
+// in host order.
+inline zero_copy_prelude clear_to_send_for(zero_copy_prelude const& p)
+{
+    boost::uint64_t const channel
+        = p.flags >> zero_copy_prelude::channel_shift;
+
+    zero_copy_prelude cts = zero_copy_prelude();
+    cts.flags = zero_copy_prelude::clear_to_send
+              | (channel << zero_copy_prelude::channel_shift);
+    cts.body_size = p.body_size;
+    return cts;
+}
+
+// Bitwise leaves that can be converted for a peer of the other endianness by
+// reversing the bytes of each element: fundamental types and flat vectors of
+// them. Other bitwise leaves take the slow path for such peers, and so does
+// long double, whose padding and layout differ between platforms.
+template <typename T>
+struct is_byte_swappable : boost::is_arithmetic<T> { };
+
+template <typename T, typename Allocator>
+struct is_byte_swappable<std::vector<T, Allocator> >
+  : boost::is_arithmetic<T> { };
+
+template <typename Allocator>
+struct is_byte_swappable<std::vector<bool, Allocator> >
+  : boost::mpl::false_ { };
+
+template <>
+struct is_byte_swappable<long double> : boost::mpl::false_ { };
+
+template <typename Allocator>
+struct is_byte_swappable<std::vector<long double, Allocator> >
+  : boost::mpl::false_ { };
+
+// Handing off vectors to a peer that shares memory with us, instead of sending
+// them. A transport that can do this comes with overloads of these for its
+// native handle and its allocator (see shm_transport.hpp), found by argument
+// dependent lookup; for all others, vectors are sent.
+
+// Is [data, data + n), allocated by a, a block that the peer of h can adopt?
+// If so, offset is where it is.
+template <typename Handle, typename Allocator>
+inline bool shared_block(
+    Handle
+  , Allocator const&
+  , void const*
+  , std::size_t
+  , boost::uint64_t&
+    )
+{
+    return false;
+}
+
+// Take a reference to the block at offset on behalf of the peer.
+template <typename Handle>
+inline void share_block(Handle, boost::uint64_t) {}
+
+// Make the block at offset, which holds elements Ts, the storage of v.
+// Returns false if v can't take it.
+template <typename Handle, typename T, typename Allocator>
+inline bool adopt_block(
+    Handle
+  , std::vector<T, Allocator>&
+  , std::size_t
+  , boost::uint64_t
+    )
+{
+    return false;
+}
+
+// What it takes to send a parcel; see zero_copy_oarchive::serialized_size().
+struct zero_copy_size
+{
+    std::size_t bytes;        ///< Bytes on the wire, prelude included.
+    std::size_t chunks;       ///< Entries in the chunk size table.
+    std::size_t buffers;      ///< Buffers in the message. An estimate, as runs
+                              ///  of copies may be split over arena blocks.
+    std::size_t inline_bytes; ///< Bytes copied into the arena.
+    std::size_t slow_bytes;   ///< Bytes in the slow segment.
+
+    zero_copy_size()
+      : bytes(0)
+      , chunks(0)
+      , buffers(0)
+      , inline_bytes(0)
+      , slow_bytes(0)
+    {}
+};
 
+// Types marked with BOOST_IS_BITWISE_SERIALIZABLE are bitwise leaves too.
 template <typename T, typename enable = void>
-struct is_bitwise_serializable : boost::is_arithmetic<T>::type { };
+struct is_bitwise_serializable
+  : boost::serialization::is_bitwise_serializable<T>::type { };
 
 template <typename T>
 struct is_bitwise_serializable<const T> : is_bitwise_serializable<T> { };
@@ -41,11 +215,139 @@ struct is_bitwise_serializable<T&> : is_bitwise_serializable<T> { };
 template <typename T>
 struct is_bitwise_serializable<T&&> : is_bitwise_serializable<T> { };
 
+template <typename T>
+struct is_std_vector : boost::mpl::false_ { };
+
+template <typename T, typename Allocator>
+struct is_std_vector<std::vector<T, Allocator> > : boost::mpl::true_ { };
+
 // This specialization has to be done not just for std::vector, but for other
 // special cases of boost::asio::buffer, such as boost::array, std::array,
-// perhaps std::valarray too.
-template <typename T>
-struct is_bitwise_serializable<std::vector<T> > : is_bitwise_serializable<T> { };
+// perhaps std::valarray too. A vector is a single zero-copy chunk only if its
+// elements are flat; the elements of a std::vector<std::vector<double> > are
+// pointers, not data.
+template <typename T, typename Allocator>
+struct is_bitwise_serializable<std::vector<T, Allocator> >
+  : boost::mpl::bool_<
+        is_bitwise_serializable<T>::value && !is_std_vector<T>::value
+    > { };
+
+// std::vector<bool> is packed, so there is nothing to point a buffer at.
+template <typename Allocator>
+struct is_bitwise_serializable<std::vector<bool, Allocator> >
+  : boost::mpl::false_ { };
+
+namespace detail
+{
+    struct serialize_probe {};
+
+    // Classes that only let boost::serialization::access call their
+    // serialize() can't be probed with a call. Instead, look the name up in a
+    // class derived from both T and a class with a serialize() member: it is
+    // ambiguous if T has one, whatever its access. Name lookup doesn't check
+    // access, so this sees private members too. Final classes can't be
+    // derived from; only a public serialize() of theirs is found.
+    struct serialize_name
+    {
+        void serialize();
+    };
+
+    template <typename T>
+    struct serialize_name_lookup : T, serialize_name {};
+
+    template <typename T, bool Derivable = boost::is_class<T>::value
+                                        && !boost::is_final<T>::value>
+    struct has_serialize_name
+    {
+        template <typename U>
+        static boost::type_traits::no_type test(
+            decltype(&serialize_name_lookup<U>::serialize)*);
+
+        template <typename U>
+        static boost::type_traits::yes_type test(...);
+
+        BOOST_STATIC_CONSTANT(bool, value =
+            sizeof(test<T>(0)) == sizeof(boost::type_traits::yes_type));
+    };
+
+    template <typename T>
+    struct has_serialize_name<T, false> : boost::mpl::false_ { };
+
+    template <typename T>
+    struct has_serialize_member
+    {
+        template <typename U>
+        static boost::type_traits::yes_type test(decltype(
+            std::declval<U&>().serialize(
+                std::declval<serialize_probe&>(), 0u))*);
+
+        template <typename U>
+        static boost::type_traits::no_type test(...);
+
+        BOOST_STATIC_CONSTANT(bool, value =
+            sizeof(test<T>(0)) == sizeof(boost::type_traits::yes_type)
+         || has_serialize_name<T>::value);
+    };
+}
+
+// Classes with a serialize() member are walked field by field, so their
+// bitwise members and vectors still go out as zero-copy chunks. That includes
+// a private serialize() that boost::serialization::access is a friend for.
+// Classes that are serialized by a free function can opt in by specializing
+// this trait. Everything else is a leaf.
+//
+// NOTE: Both passes of zero_copy_iarchive call serialize()/load(). The shape
+// of the data (e.g. vector sizes) must come from the chunk size table, not
+// from values loaded earlier in the same message.
+template <typename T, typename enable = void>
+struct is_zero_copy_traversable
+  : boost::mpl::bool_<
+        detail::has_serialize_member<T>::value
+     && !is_bitwise_serializable<T>::value
+    > { };
+
+// Vectors of vectors, or of traversable classes, are walked element by
+// element: the outer size goes into the chunk size table and every element
+// is dispatched on its own, so each flat inner vector is its own zero-copy
+// chunk.
+template <typename T, typename Allocator>
+struct is_zero_copy_traversable<std::vector<T, Allocator> >
+  : boost::mpl::bool_<
+        !is_bitwise_serializable<std::vector<T, Allocator> >::value
+     && (   (is_bitwise_serializable<T>::value && is_std_vector<T>::value)
+         || is_zero_copy_traversable<T>::value)
+    > { };
+
+namespace detail
+{
+    // Completion handler of an owning async_write(). Keeps the parcel alive
+    // while the message is queued, then hands it back to the caller along
+    // with the outcome of the write.
+    template <typename Pointer, typename Handler>
+    struct return_parcel
+    {
+        boost::shared_ptr<Pointer> parcel;
+        Handler handler;
+
+        return_parcel(boost::shared_ptr<Pointer> const& p, Handler const& h)
+          : parcel(p)
+          , handler(h)
+        {}
+
+        void operator()(boost::system::error_code const& e)
+        {
+            handler(e, std::move(*parcel));
+        }
+    };
+
+    // Handler of an owning async_write() that doesn't want the parcel back.
+    struct discard_parcel
+    {
+        template <typename Pointer>
+        void operator()(boost::system::error_code const&, Pointer const&)
+            const {}
+    };
+}
 
 // We never directly serialize an std::vector; we actually only serialize one
 // type (a parcel). Parcels contain a polymorphic object (an action) that has
@@ -53,447 +355,3271 @@ struct is_bitwise_serializable<std::vector<T> > : is_bitwise_serializable<T> { }
 // for std::vector and other none polymorphic types. On the receiving end, we
 // will know how to read the data because the polymorphic type was serialized
 // normally through Boost.Serialization.
-struct zero_copy_oarchive : boost::enable_shared_from_this<zero_copy_oarchive>
+//
+// Stream is the connection the archive writes to, a TCP or UNIX domain socket
+// for instance (see stream_transport.hpp).
+template <typename Stream>
+struct basic_zero_copy_oarchive
+  : boost::enable_shared_from_this<basic_zero_copy_oarchive<Stream> >
 {
-    typedef std::function<void()> handler_type;
+    typedef std::function<void(boost::system::error_code const&)>
+        handler_type;
 
     typedef boost::mpl::false_ is_loading;
     typedef boost::mpl::true_ is_saving;
 
   private:
-    boost::asio::ip::tcp::socket* socket_;
+    // A serialized message waiting in the send queue. It takes over the
+    // arena, the prelude and the slow segment from the archive, so that the
+    // next parcel can be serialized while it is in flight.
+    struct queued_message
+    {
+        zero_copy_arena<boost::asio::const_buffer> arena;
+        zero_copy_prelude prelude;
+        std::vector<char> slow_buffer;
+        std::size_t bytes;
+        handler_type handler;
+    };
 
-    handler_type handler_;
+    typedef boost::shared_ptr<queued_message> queued_message_ptr;
 
-    bool homogeneity_; ///< Is it safe to do bitwise serialization? E.g. does
-                       ///  the target have the endianness as us, etc?
+    typedef typename Stream::native_handle_type native_handle_type;
 
-    std::vector<boost::asio::const_buffer> message_;
-    std::vector<boost::integer::ulittle64_t> chunk_sizes_;
-    boost::integer::ulittle64_t chunks_; // chunk_sizes_.size()
+    Stream* socket_;
 
-    std::vector<std::vector<char> > slow_buffers_;
+    bool homogeneity_; ///< Is it safe to do bitwise serialization? E.g. does
+                       ///  the target have the endianness as us, etc?
+    bool swap_bytes_;  ///< Are bitwise fields byte swapped on the wire?
+    peer_layout peer_; ///< As negotiated with the peer.
+
+    zero_copy_arena<boost::asio::const_buffer> arena_;
+    zero_copy_prelude prelude_;
+
+    std::vector<char> slow_buffer_; ///< Scratch space for slow_save, or the
+                                    ///  slow segment of the current message.
+
+    bool shared_slow_path_;
+    boost::scoped_ptr<vector_streambuf> slow_streambuf_;
+    boost::scoped_ptr<portable_binary_oarchive> slow_archive_;
+
+    std::size_t gather_threshold_; ///< Largest field that is copied into the
+                                   ///  arena instead of getting its own buffer.
+    bool inline_run_; ///< Is the last buffer of the message a run of copies?
+
+    // The size-only pass of serialized_size() walks the parcel like write()
+    // does, but only counts.
+    bool presizing_; ///< Do write() and async_write() run it first?
+    bool sizing_;
+    zero_copy_size size_;
+    boost::scoped_ptr<counting_streambuf> size_streambuf_;
+    boost::scoped_ptr<portable_binary_oarchive> size_archive_;
+
+    std::vector<iovec> iovecs_;
+    std::size_t last_syscalls_;
+    std::size_t total_syscalls_;
+
+    std::deque<queued_message_ptr> send_queue_;
+    std::vector<queued_message_ptr> free_messages_; ///< Recycled storage.
+    std::size_t send_queue_depth_;
+    std::size_t sent_; ///< Bytes of the first queued message already written.
+    bool writing_;     ///< Are we waiting for the socket to become writable?
+    bool non_blocking_; ///< The socket's mode before the send queue started.
+
+    std::size_t rendezvous_threshold_; ///< Largest body write() sends without
+                                       ///  waiting for the receiver.
+    bool rendezvous_; ///< Does the current message wait for the receiver?
+    std::size_t eager_messages_;
+    std::size_t rendezvous_messages_;
+
+    boost::uint32_t channel_; ///< Stamped on every message.
+    bool owns_socket_;
+
+    std::vector<Stream*> stripes_;
+    stripe_workers<native_handle_type> stripe_workers_;
+    std::size_t stripe_size_;
+    std::size_t stripe_threshold_;
+    std::vector<stripe_range> stripe_ranges_; ///< Of the current message.
+    std::vector<std::vector<iovec> > stripe_iovecs_;
+
+    boost::shared_ptr<chunk_codec> codec_;
+    std::size_t compression_threshold_;
+    double compression_ratio_;
+    std::vector<char> codec_scratch_; ///< Encoded compressibility samples.
+    std::size_t codec_bytes_in_;
+    std::size_t codec_bytes_out_;
+    std::size_t handed_off_bytes_;
+
+    bool checksum_;
+    boost::uint32_t crc_; ///< Of the body of the current message, so far.
 
   public:
-    zero_copy_oarchive(
-        boost::asio::ip::tcp::socket& socket
-      , bool homogeneity = true
+    BOOST_STATIC_CONSTANT(std::size_t, default_gather_threshold = 512);
+    BOOST_STATIC_CONSTANT(std::size_t, default_send_queue_depth = 64);
+    BOOST_STATIC_CONSTANT(std::size_t, default_rendezvous_threshold
+                                     = std::size_t(64) << 20);
+    BOOST_STATIC_CONSTANT(std::size_t, default_stripe_size
+                                     = std::size_t(1) << 20);
+    BOOST_STATIC_CONSTANT(std::size_t, default_stripe_threshold
+                                     = std::size_t(8) << 20);
+    BOOST_STATIC_CONSTANT(std::size_t, default_compression_threshold
+                                     = std::size_t(256) << 10);
+    BOOST_STATIC_CONSTANT(std::size_t, compression_samples = 4);
+    BOOST_STATIC_CONSTANT(std::size_t, compression_sample_size = 4096);
+
+    basic_zero_copy_oarchive(
+        Stream& socket
+      , bool homogeneity = false
         )
       : socket_(&socket)
-      , handler_()
       , homogeneity_(homogeneity)
-      , message_()
-      , chunk_sizes_()
-      , chunks_()
-      , slow_buffers_()
+      , swap_bytes_(false)
+      , peer_(homogeneity ? homogeneous_peer : heterogeneous_peer)
+      , arena_()
+      , prelude_()
+      , slow_buffer_()
+      , shared_slow_path_(true)
+      , slow_streambuf_()
+      , slow_archive_()
+      , gather_threshold_(default_gather_threshold)
+      , inline_run_(false)
+      , presizing_(false)
+      , sizing_(false)
+      , size_()
+      , size_streambuf_()
+      , size_archive_()
+      , iovecs_()
+      , last_syscalls_(0)
+      , total_syscalls_(0)
+      , send_queue_()
+      , free_messages_()
+      , send_queue_depth_(default_send_queue_depth)
+      , sent_(0)
+      , writing_(false)
+      , non_blocking_(false)
+      , rendezvous_threshold_(default_rendezvous_threshold)
+      , rendezvous_(false)
+      , eager_messages_(0)
+      , rendezvous_messages_(0)
+      , channel_(0)
+      , owns_socket_(true)
+      , stripes_()
+      , stripe_workers_()
+      , stripe_size_(default_stripe_size)
+      , stripe_threshold_(default_stripe_threshold)
+      , stripe_ranges_()
+      , stripe_iovecs_()
+      , codec_()
+      , compression_threshold_(default_compression_threshold)
+      , compression_ratio_(0.9)
+      , codec_scratch_()
+      , codec_bytes_in_(0)
+      , codec_bytes_out_(0)
+      , handed_off_bytes_(0)
+      , checksum_(false)
+      , crc_(0)
     {}
 
-    ~zero_copy_oarchive()
+    ~basic_zero_copy_oarchive()
     {
-        // Gracefully and portably shutdown the socket.
-        boost::system::error_code ec;
-        socket_->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-        socket_->close(ec);
+        if (!owns_socket_)
+            return;
+
+        close_stream(*socket_);
     }
 
-    template <typename T>
-    void operator& (T const& t) { dispatch(t); }
+    // Whether the socket is shut down and closed along with the archive.
+    // Turn this off if the socket is shared with other archives.
+    bool owns_socket() const
+    {
+        return owns_socket_;
+    }
 
-    template <typename T>
-    void operator<< (T const& t) { dispatch(t); }
+    void owns_socket(bool o)
+    {
+        owns_socket_ = o;
+    }
 
-    // NOTE: The lifetime of the data we're serializing is controlled, so t
-    // going out of scope isn't an issue.
-    template <typename T>
-    void dispatch(T const& t)
+    // The channel the following messages are sent on. Independent streams
+    // can share one connection by sending on channels of their own through
+    // the same archive; the receive loop of the other end routes them (see
+    // zero_copy_iarchive::open_channel()). Every message is framed on its
+    // own, so messages of different channels never interleave.
+    boost::uint32_t channel() const
     {
-        typedef typename is_bitwise_serializable<T>::type predicate_type;
+        return channel_;
+    }
 
-        if (homogeneity_ && predicate_type::value)
-            save<T>::call(this, t);
-        else
-            slow_save(t);
+    void channel(boost::uint32_t c)
+    {
+        channel_ = c;
     }
 
-    template <typename T>
-    struct save
+    // Whether fields are serialized bitwise. Set this from the result of
+    // negotiate_homogeneity() once the connection is established; until
+    // then everything takes the slow path.
+    bool homogeneity() const
     {
-        static void call(zero_copy_oarchive* self, T const& t)
-        {
-            self->message_.push_back(boost::asio::buffer(&t, sizeof(t)));
-        }
-    };
+        return homogeneity_;
+    }
 
-    // This specialization has to be done not just for std::vector, but for
-    // other special cases of boost::asio::buffer, such as boost::array,
-    // std::array, perhaps std::valarray too.
-    template <typename T>
-    struct save<std::vector<T> >
+    void homogeneity(bool h)
     {
-        static void call(zero_copy_oarchive* self, std::vector<T> const& t)
-        {
-            // Save the size, so we can know how much to read on the other end.
-            // This allows us to do zero copy when reading.
-            self->chunk_sizes_.push_back(t.size());
+        homogeneity_ = h;
+    }
 
-            self->message_.push_back(boost::asio::buffer(t));
-        } 
-    };
+    // Whether bitwise fields are converted between host order and the little
+    // endian wire order. Only big endian hosts ever need this.
+    bool swap_bytes() const
+    {
+        return swap_bytes_;
+    }
 
-    template <typename T>
-    void slow_save(T&& t)
+    void swap_bytes(bool s)
     {
-        slow_buffers_.push_back(std::vector<char>());
-        std::vector<char>& slow_buffer_ = slow_buffers_.back();
+        swap_bytes_ = s;
+    }
 
-        typedef container_device<std::vector<char> > io_device_type;
-        boost::iostreams::stream<io_device_type> io(slow_buffer_);
+    // Configure bitwise serialization from the result of
+    // negotiate_peer_layout(). With a byte_swapped_peer, only the big endian
+    // end swaps bytes, but both ends send the bitwise leaves that can't be
+    // swapped (see is_byte_swappable) down the slow path.
+    peer_layout peer() const
+    {
+        return peer_;
+    }
 
-        {
-            // Serialize t the slow way.
-            portable_binary_oarchive archive(io);
-            archive & t;
-        }
+    void peer(peer_layout layout)
+    {
+        peer_ = layout;
+        homogeneity_ = (heterogeneous_peer != layout);
+#if defined(BOOST_BIG_ENDIAN)
+        swap_bytes_ = (byte_swapped_peer == layout);
+#else
+        swap_bytes_ = false;
+#endif
+    }
 
-        // Save the size, so we can know how much to read on the other end.
-        // This allows us to do zero copy when reading.
-        chunk_sizes_.push_back(slow_buffer_.size());
+    // Whether the peer has the other endianness.
+    bool byte_swapped() const
+    {
+        return swap_bytes_ || (byte_swapped_peer == peer_);
+    }
 
-        message_.push_back(boost::asio::buffer(slow_buffer_));
+    // Number of bytes held by this connection's arena.
+    std::size_t arena_bytes() const
+    {
+        return arena_.reserved_bytes();
     }
 
-    // Synchronously write a data structure to the socket.
-    template <typename Parcel>
-    void write(Parcel const& p)
+    // Fields of at most this many bytes are copied into a contiguous run in
+    // the arena instead of being sent as a buffer of their own. Zero disables
+    // coalescing (see calibrate_gather_threshold()).
+    std::size_t gather_threshold() const
     {
-        // The first buffer is the number of elements in the list. The second
-        // buffer is our list of sizes. We'll fill these in later.
-        message_.push_back(boost::asio::buffer(&chunks_, sizeof(chunks_)));
-        message_.push_back(boost::asio::const_buffer());
+        return gather_threshold_;
+    }
 
-        *this & p;
+    void gather_threshold(std::size_t bytes)
+    {
+        gather_threshold_ = bytes;
+    }
 
-        // NOTE: Non-container chunks (e.g. single elements) are not in the size
-        // list.
-        chunks_ = chunk_sizes_.size();
-        message_.at(1) = boost::asio::buffer(chunk_sizes_);
+    // Whether the fields that aren't bitwise share one slow segment with a
+    // single archive header per message, instead of being serialized with an
+    // archive each. The receiver picks this up from the prelude.
+    bool shared_slow_path() const
+    {
+        return shared_slow_path_;
+    }
 
-        boost::asio::write(*socket_, message_);
+    void shared_slow_path(bool s)
+    {
+        shared_slow_path_ = s;
+    }
 
-        message_.clear();
-        chunk_sizes_.clear();
-        chunks_ = 0;
-        slow_buffers_.clear();
+    // Messages whose body is larger than this are sent by write() with the
+    // rendezvous protocol: the prelude and the size table go first, and the
+    // body only once the receiver has laid out the parcel and replied with a
+    // clear_to_send frame. The receiver never has more than one such body in
+    // flight, and gets to place it before any of it arrives. write() throws
+    // archive_exception if the reply isn't the clear_to_send for the message.
+    // NOTE: The reply is read from the socket, so the peer must not be
+    // sending anything else on it while write() waits. async_write() always
+    // sends eagerly.
+    std::size_t rendezvous_threshold() const
+    {
+        return rendezvous_threshold_;
     }
 
-    // Asynchronously write a data structure to the socket.
-    template <typename Parcel>
-    void async_write(Parcel const& p, handler_type const& h = handler_type())
+    void rendezvous_threshold(std::size_t bytes)
     {
-        handler_ = h;
+        rendezvous_threshold_ = bytes;
+    }
 
-        // The first buffer is the number of elements in the list. The second
-        // buffer is our list of sizes. We'll fill these in later.
-        message_.push_back(boost::asio::buffer(&chunks_, sizeof(chunks_)));
-        message_.push_back(boost::asio::const_buffer());
+    // Number of messages sent in one go.
+    std::size_t eager_messages() const
+    {
+        return eager_messages_;
+    }
 
-        // FIXME: Not sure if this is the correct way to kick off the
-        // serialization call chain.
-        *this & p;
+    // Number of messages whose body waited for the receiver.
+    std::size_t rendezvous_messages() const
+    {
+        return rendezvous_messages_;
+    }
 
-        // NOTE: Non-container chunks (e.g. single elements) are not in the size
-        // list.
-        chunks_ = chunk_sizes_.size();
-        message_.at(1) = boost::asio::buffer(chunk_sizes_);
+    // Add a connection to the same peer that write() stripes large chunks
+    // over; the other end has to add its end of the connections in the same
+    // order (see zero_copy_iarchive::add_stripe()). Each stripe connection is
+    // written by a worker thread of its own, which lives as long as the
+    // archive, while the rest of the message goes over the main connection.
+    // The archive doesn't close stripe connections.
+    void add_stripe(Stream& s)
+    {
+        stripes_.push_back(&s);
+        stripe_workers_.add(s.native_handle());
+        stripe_iovecs_.resize(stripes_.size());
+    }
 
-        boost::asio::async_write(*socket_, message_,
-            boost::bind(&zero_copy_oarchive::handle_write<Parcel>,
-                shared_from_this(),
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred,
-                p));
+    std::size_t stripes() const
+    {
+        return stripes_.size();
     }
 
-    template <typename Parcel>
-    void handle_write(
-        boost::system::error_code const& e
-      , std::size_t bytes
-      , Parcel& p
-        )
+    // Striped chunks are dealt out to the stripe connections in pieces of
+    // this many bytes.
+    std::size_t stripe_size() const
     {
-        if (handler_)
-            handler_();
+        return stripe_size_;
+    }
 
-        message_.clear();
-        chunk_sizes_.clear();
-        chunks_ = 0;
-        slow_buffers_.clear();
+    void stripe_size(std::size_t bytes)
+    {
+        BOOST_ASSERT(0 != bytes);
+        stripe_size_ = bytes;
     }
-};
 
-// Note: We must "deserialize" the object BEFORE we read the data, but AFTER
-// we have read the sizes. This allows us to do zero-copy, because we know the
-// layout of the data structure before we call async_read.
-struct zero_copy_iarchive : boost::enable_shared_from_this<zero_copy_oarchive>
-{
-    typedef std::function<void()> handler_type;
+    // Chunks of at least this many bytes are striped.
+    std::size_t stripe_threshold() const
+    {
+        return stripe_threshold_;
+    }
 
-    typedef boost::mpl::true_ is_loading;
-    typedef boost::mpl::false_ is_saving;
+    void stripe_threshold(std::size_t bytes)
+    {
+        stripe_threshold_ = bytes;
+    }
 
-  private:
-    boost::asio::ip::tcp::socket* socket_;
+    // The codec that bitwise vectors of at least compression_threshold()
+    // bytes are encoded with, or none (the default). The receiver looks the
+    // codec up in chunk_codecs by its id. Whether a vector is worth encoding
+    // is decided for each of them, from a few samples (see
+    // compression_ratio()).
+    boost::shared_ptr<chunk_codec> const& codec() const
+    {
+        return codec_;
+    }
 
-    handler_type handler_;
+    void codec(boost::shared_ptr<chunk_codec> const& c)
+    {
+        codec_ = c;
+    }
 
-    bool homogeneity_; ///< Is it safe to do bitwise serialization? E.g. does
-                       ///  the target have the endianness as us, etc?
+    std::size_t compression_threshold() const
+    {
+        return compression_threshold_;
+    }
 
-    std::size_t pass_; 
+    void compression_threshold(std::size_t bytes)
+    {
+        compression_threshold_ = bytes;
+    }
 
-    std::vector<boost::asio::mutable_buffer> message_;
-    std::vector<boost::integer::ulittle64_t> chunk_sizes_;
-    boost::integer::ulittle64_t chunks_; // chunk_sizes_.size()
-    std::size_t current_chunk_;
+    // A vector is encoded if compression_samples samples of it, spread over
+    // its bytes, shrink to at most this fraction of their size; otherwise it
+    // is sent from where it is. The default is 0.9. At 1 or above, every
+    // vector that is large enough is encoded without sampling.
+    double compression_ratio() const
+    {
+        return compression_ratio_;
+    }
 
-    std::vector<std::vector<char> > slow_buffers_;
-    std::size_t current_slow_buffer_;
+    void compression_ratio(double r)
+    {
+        compression_ratio_ = r;
+    }
 
-  public:
-    zero_copy_iarchive(
-        boost::asio::ip::tcp::socket& socket 
-      , bool homogeneity = true
-        )
-      : socket_(&socket)
-      , handler_()
-      , homogeneity_(homogeneity)
-      , pass_(0)
-      , message_()
-      , chunk_sizes_()
-      , current_chunk_(0)
-      , slow_buffers_()
-      , current_slow_buffer_(0)
-    {}
+    // Whether every message carries a CRC32C of its body, which the receiver
+    // checks. The checksum is computed while the body is copied into the
+    // arena where it is, so mostly the large buffers that are sent from
+    // where they are cost an extra pass.
+    bool checksum() const
+    {
+        return checksum_;
+    }
 
-    ~zero_copy_iarchive()
+    void checksum(bool c)
     {
-        // Gracefully and portably shutdown the socket.
-        boost::system::error_code ec;
-        socket_->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
-        socket_->close(ec);
+        checksum_ = c;
     }
 
-    template <typename T>
-    void operator& (T& t) { dispatch(t); }
+    // Bytes of the vectors that were encoded, before and after encoding.
+    std::size_t codec_bytes_in() const
+    {
+        return codec_bytes_in_;
+    }
 
-    template <typename T>
-    void operator>> (T& t) { dispatch(t); }
+    std::size_t codec_bytes_out() const
+    {
+        return codec_bytes_out_;
+    }
 
-    template <typename T>
-    void dispatch(T& t)
+    // Bytes of the vectors that were handed off to the peer instead of being
+    // sent (see hand_off()).
+    std::size_t handed_off_bytes() const
     {
-        typedef typename is_bitwise_serializable<T>::type predicate_type;
+        return handed_off_bytes_;
+    }
 
-        // Pass 1 builds the structure of message_. It is done right before
-        // message_ is read.
-        if (1 == pass_)
+    // Number of messages async_write() accepts before the earliest of them
+    // has been written.
+    std::size_t send_queue_depth() const
+    {
+        return send_queue_depth_;
+    }
+
+    void send_queue_depth(std::size_t depth)
+    {
+        send_queue_depth_ = depth;
+    }
+
+    // Number of messages posted with async_write() that haven't completed.
+    std::size_t queued() const
+    {
+        return send_queue_.size();
+    }
+
+    // Number of system calls made by the last call to write().
+    std::size_t last_syscalls() const
+    {
+        return last_syscalls_;
+    }
+
+    // Number of system calls made by all calls to write(), and all writes of
+    // the send queue.
+    std::size_t total_syscalls() const
+    {
+        return total_syscalls_;
+    }
+
+    // Walk p without writing anything, and return the exact size of the
+    // message write(p) would send. This costs a pass over the parcel, and an
+    // encoding into nothing of the fields that take the slow path. With a
+    // codec, vectors that may be encoded are counted at their largest
+    // encoded size, so the size is an upper bound.
+    template <typename Parcel>
+    zero_copy_size serialized_size(Parcel const& p)
+    {
+        size_ = zero_copy_size();
+        sizing_ = true;
+        inline_run_ = false;
+
+        *this & p;
+
+        if (size_archive_)
         {
-            if (homogeneity_ && predicate_type::value)
-                load_pass1<T>::call(this, t);
-            else
-                slow_load_pass1(t);
+            size_.slow_bytes = size_streambuf_->size();
+            size_.bytes += size_.slow_bytes;
+            ++size_.buffers;
+
+            size_archive_.reset();
+            size_streambuf_.reset();
         }
 
-        // Pass 2 decodes message_ after it has been read.
-        else if (2 == pass_)
+        if (checksum_)
         {
-            if (homogeneity_ && predicate_type::value)
-                load_pass2<T>::call(this, t);
-            else
-                slow_load_pass2(t);
+            size_.bytes += sizeof(boost::integer::ulittle64_t);
+            size_.inline_bytes += sizeof(boost::integer::ulittle64_t);
+            ++size_.buffers;
         }
 
-        else
-            BOOST_ASSERT(false);
+        sizing_ = false;
+        inline_run_ = false;
+
+        // The prelude, and the chunk sizes that don't fit into it.
+        size_.bytes += sizeof(zero_copy_prelude);
+        if (size_.chunks > zero_copy_prelude::inline_chunks)
+            size_.bytes += (size_.chunks - zero_copy_prelude::inline_chunks)
+                         * sizeof(boost::integer::ulittle64_t);
+        size_.buffers += 2;
+
+        return size_;
     }
 
-    template <typename T>
-    struct load_pass1
+    // Have write() and async_write() run serialized_size() before each
+    // message, and reserve everything it needs up front. Off by default: the
+    // arena, the buffer list and the size table keep their capacity between
+    // messages, so once they have grown to fit the traffic, a message doesn't
+    // allocate anyway, and the extra pass over the parcel is pure cost. Worth
+    // it for parcels whose shape changes a lot from message to message.
+    bool presizing() const
     {
-        static void call(zero_copy_iarchive* self, T& t)
-        {
-            self->message_.push_back(boost::asio::buffer(&t, sizeof(T)));
-        } 
-    };
+        return presizing_;
+    }
 
-    // This specialization has to be done not just for std::vector, but for
-    // other special cases of boost::asio::buffer, such as boost::array,
-    // std::array, perhaps std::valarray too.
-    template <typename T>
-    struct load_pass1<std::vector<T> >
+    void presizing(bool p)
     {
-        static void call(zero_copy_iarchive* self, std::vector<T>& t)
-        {
-            // Use the size list to figure out how large this vector needs to be.
-            t.resize(self->chunk_sizes_.at(self->current_chunk_++));
-
-            self->message_.push_back(boost::asio::buffer(t));
-        } 
-    };
+        presizing_ = p;
+    }
 
-    // This specialization has to be done not just for std::vector, but for
-    // other special cases of boost::asio::buffer, such as boost::array,
-    // std::array, perhaps std::valarray too. For this pass, the general case
-    // (no-op) also works for std::vector, etc.
     template <typename T>
-    struct load_pass2
+    basic_zero_copy_oarchive& operator& (T const& t)
     {
-        static void call(zero_copy_iarchive*, T&)
-        {
-            // No-op.
-        }
-    };
+        dispatch(t);
+        return *this;
+    }
 
     template <typename T>
-    void slow_load_pass1(T& t)
+    basic_zero_copy_oarchive& operator<< (T const& t)
     {
-        // Use the size list to figure out how large this vector has to be.
-        slow_buffers_.push_back(std::vector<char>
-            (chunk_sizes_.at(current_chunk_++)));
-        std::vector<char>& slow_buffer_ = slow_buffers_.back();
-
-        message_.push_back(boost::asio::buffer(slow_buffer_));
+        dispatch(t);
+        return *this;
     }
 
     template <typename T>
-    void slow_load_pass2(T& t)
+    basic_zero_copy_oarchive& operator& (boost::serialization::nvp<T> const& t)
     {
-        std::vector<char>& slow_buffer_
-            = slow_buffers_.at(current_slow_buffer_++);
+        dispatch(t.const_value());
+        return *this;
+    }
 
-        typedef container_device<std::vector<char> > io_device_type;
-        boost::iostreams::stream<io_device_type> io(slow_buffer_);
+    template <typename T>
+    basic_zero_copy_oarchive& operator<< (boost::serialization::nvp<T> const& t)
+    {
+        dispatch(t.const_value());
+        return *this;
+    }
+
+    // The rest of the Boost.Serialization archive interface.
+    template <typename T>
+    void register_type(T const* = 0) {}
+
+    boost::archive::library_version_type get_library_version() const
+    {
+        return boost::archive::BOOST_ARCHIVE_VERSION();
+    }
+
+    void save_binary(void const* address, std::size_t count)
+    {
+        gather(address, count);
+    }
+
+    // NOTE: The lifetime of the data we're serializing is controlled, so t
+    // going out of scope isn't an issue.
+    template <typename T>
+    void dispatch(T const& t)
+    {
+        dispatch(t, typename is_zero_copy_traversable<T>::type());
+    }
+
+    template <typename T>
+    void dispatch(T const& t, boost::mpl::true_)
+    {
+        traverse(t);
+    }
+
+    // Walk a user class field by field.
+    template <typename T>
+    void traverse(T const& t)
+    {
+        boost::serialization::serialize_adl(*this, const_cast<T&>(t)
+          , boost::serialization::version<T>::value);
+    }
+
+    template <typename T, typename Allocator>
+    void traverse(std::vector<T, Allocator> const& t)
+    {
+        // The shape of the outer vector goes into the size list, so the other
+        // end can size it before reading anything.
+        add_chunk_size(t.size());
+
+        for (std::size_t i = 0; i < t.size(); ++i)
+            dispatch(t[i]);
+    }
+
+    template <typename T>
+    void dispatch(T const& t, boost::mpl::false_)
+    {
+        leaf(t, typename is_bitwise_serializable<T>::type());
+    }
+
+    template <typename T>
+    void leaf(T const& t, boost::mpl::true_)
+    {
+        typedef typename is_byte_swappable<T>::type swappable;
+
+        if (!homogeneity_ || (byte_swapped() && !swappable::value))
+            slow_save(t);
+        else if (swap_bytes_)
+            save_swapped(t, swappable());
+        else
+            save<T>::call(this, t);
+    }
+
+    template <typename T>
+    void leaf(T const& t, boost::mpl::false_)
+    {
+        slow_save(t);
+    }
+
+    template <typename T>
+    struct save
+    {
+        static void call(basic_zero_copy_oarchive* self, T const& t)
+        {
+            self->gather(&t, sizeof(t));
+        }
+    };
 
+    // This specialization has to be done not just for std::vector, but for
+    // other special cases of boost::asio::buffer, such as boost::array,
+    // std::array, perhaps std::valarray too.
+    template <typename T, typename Allocator>
+    struct save<std::vector<T, Allocator> >
+    {
+        static void call(
+            basic_zero_copy_oarchive* self
+          , std::vector<T, Allocator> const& t
+            )
         {
-            // Deserialize t the slow way.
-            portable_binary_iarchive archive(io);
+            if (   !t.empty()
+                && (   self->hand_off(t)
+                    || self->encode(&t[0], t.size(), sizeof(T))))
+                return;
+
+            // Save the size, so we can know how much to read on the other end.
+            // This allows us to do zero copy when reading.
+            self->add_chunk_size(t.size());
+
+            if (!t.empty())
+                self->gather(&t[0], t.size() * sizeof(T));
+        } 
+    };
+
+    // The byte swapped copy has to live somewhere, so these fields always go
+    // into the arena, whatever their size.
+    template <typename T>
+    void save_swapped(T const& t, boost::mpl::true_)
+    {
+        if (sizing_)
+        {
+            count(sizeof(T), true);
+            return;
+        }
+
+        char* p = append_inline(sizeof(T));
+        byte_swap_copy(&t, p, 1);
+        checksum_body(p, sizeof(T));
+    }
+
+    template <typename T, typename Allocator>
+    void save_swapped(std::vector<T, Allocator> const& t, boost::mpl::true_)
+    {
+        add_chunk_size(t.size());
+
+        if (t.empty())
+            return;
+
+        if (sizing_)
+        {
+            count(t.size() * sizeof(T), true);
+            return;
+        }
+
+        char* p = append_inline(t.size() * sizeof(T));
+        byte_swap_copy(&t[0], p, t.size());
+        checksum_body(p, t.size() * sizeof(T));
+    }
+
+    template <typename T>
+    void save_swapped(T const& t, boost::mpl::false_)
+    {
+        slow_save(t);
+    }
+
+    template <typename T>
+    void slow_save(T&& t)
+    {
+        if (shared_slow_path_)
+        {
+            slow_save_shared(t);
+            return;
+        }
+
+        if (sizing_)
+        {
+            counting_streambuf buffer;
+
+            {
+                portable_binary_oarchive archive(buffer
+                                               , boost::archive::no_codecvt);
+                archive & t;
+            }
+
+            add_chunk_size(buffer.size());
+            if (0 != buffer.size())
+                count(buffer.size(), true);
+            return;
+        }
+
+        vector_streambuf buffer(slow_buffer_);
+
+        {
+            // Serialize t the slow way.
+            portable_binary_oarchive archive(buffer, boost::archive::no_codecvt);
             archive & t;
         }
+
+        // Save the size, so we can know how much to read on the other end.
+        // This allows us to do zero copy when reading.
+        add_chunk_size(buffer.size());
+
+        // The scratch buffer is reused for the next field, so the encoded
+        // bytes are always copied into the arena.
+        if (0 != buffer.size())
+            copy_inline(buffer.data(), buffer.size());
     }
 
-    // Synchronously read a data structure from the socket.
-    template <typename Parcel>
-    void read(Parcel& p)
+    // Serialize t into the slow segment of the message, which is sent after
+    // everything else. The chunk size table gets the offset of the end of t
+    // in the segment.
+    template <typename T>
+    void slow_save_shared(T const& t)
     {
-        // The first thing we need is the number of elements in the list of
-        // chunk sizes.
-        boost::asio::read(*socket_,
-            boost::asio::buffer(&chunks_, sizeof(chunks_)));
+        if (sizing_)
+        {
+            if (!size_archive_)
+            {
+                size_streambuf_.reset(new counting_streambuf);
+                size_archive_.reset(new portable_binary_oarchive(
+                    *size_streambuf_, boost::archive::no_codecvt));
+            }
 
-        // Now we know how large chunk_sizes_ needs to be.
-        chunk_sizes_.resize(chunks_);
+            *size_archive_ & t;
 
-        // The second thing we need is the list of chunk sizes. 
-        boost::asio::read(*socket_, boost::asio::buffer(chunk_sizes_));
+            add_chunk_size(size_streambuf_->size());
+            return;
+        }
 
-        // First pass. Create the message structure. Note that this doesn't
-        // actually read in anything.
-        pass_ = 1;
-        *this & p;
+        if (!slow_archive_)
+        {
+            // Reserve the segment size found by serialized_size().
+            slow_streambuf_.reset(
+                new vector_streambuf(slow_buffer_, size_.slow_bytes));
+            slow_archive_.reset(new portable_binary_oarchive(
+                *slow_streambuf_, boost::archive::no_codecvt));
+        }
 
-        boost::asio::read(*socket_, message_);
+        *slow_archive_ & t;
 
-        // Second pass. Do any required deserialization. 
-        pass_ = 2;
-        *this & p;
+        add_chunk_size(slow_streambuf_->size());
+    }
 
-        message_.clear();
-        chunk_sizes_.clear();
-        chunks_ = 0;
-        current_chunk_ = 0;
-        slow_buffers_.clear();
-        current_slow_buffer_ = 0;
+    void add_chunk_size(std::size_t n)
+    {
+        if (sizing_)
+            ++size_.chunks;
+        else
+            arena_.chunk_sizes().push_back(n);
     }
- 
-    // Asynchronously read a data structure from the socket.
-    template <typename Parcel>
-    void async_read(Parcel& p, handler_type const& h = handler_type())
+
+    // Account for n bytes of the body in serialized_size(); copied says
+    // whether they go into the arena.
+    void count(std::size_t n, bool copied)
     {
-        handler_ = h;
+        size_.bytes += n;
 
-        // The first thing we need is the number of elements in the list of
-        // chunk sizes.
-        boost::asio::async_read(*socket_,
-            boost::asio::buffer(&chunks_, sizeof(chunks_)),
-            boost::bind(&zero_copy_iarchive::handle_read_chunks<Parcel>,
-                shared_from_this(),
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred,
-                boost::ref(p)));
+        if (copied)
+        {
+            size_.inline_bytes += n;
+            if (!inline_run_)
+                ++size_.buffers;
+            inline_run_ = true;
+        }
+
+        else
+        {
+            ++size_.buffers;
+            inline_run_ = false;
+        }
     }
 
-    template <typename Parcel>
-    void handle_read_chunks(
-        boost::system::error_code const& e,
-        std::size_t bytes,
-        Parcel& p
+    // Add n bytes at data to the message. Payloads above the gather threshold
+    // are sent from where they are; smaller ones are copied into the arena.
+    void gather(void const* data, std::size_t n)
+    {
+        if (sizing_)
+            count(n, n <= gather_threshold_);
+
+        else if (n > gather_threshold_)
+        {
+            arena_.message().push_back(boost::asio::buffer(data, n));
+            inline_run_ = false;
+            checksum_body(data, n);
+        }
+
+        else
+            copy_inline(data, n);
+    }
+
+    void copy_inline(void const* data, std::size_t n)
+    {
+        if (checksum_)
+            crc_ = crc32c_copy(crc_, append_inline(n), data, n);
+        else
+            std::memcpy(append_inline(n), data, n);
+    }
+
+    // Add n bytes of the body, in the order they are sent, to the checksum.
+    void checksum_body(void const* data, std::size_t n)
+    {
+        if (checksum_)
+            crc_ = crc32c(crc_, data, n);
+    }
+
+    // Hand the storage of a bitwise vector to the peer instead of sending it,
+    // if the transport shares it with the peer (see shared_block()). Only its
+    // size and where it is go into the size table. Not done with a checksum,
+    // which is of the bytes that are sent. Returns false if the vector is to
+    // be sent.
+    template <typename T, typename Allocator>
+    bool hand_off(std::vector<T, Allocator> const& t)
+    {
+        native_handle_type const h = socket_->native_handle();
+        std::size_t const n = t.size() * sizeof(T);
+        boost::uint64_t offset = 0;
+
+        if (checksum_ || !shared_block(h, t.get_allocator(), &t[0], n, offset))
+            return false;
+
+        if (sizing_)
+        {
+            size_.chunks += 2;
+            return true;
+        }
+
+        BOOST_ASSERT(t.size() <= zero_copy_prelude::elements_mask);
+
+        // The peer drops this reference when it is done with the block.
+        share_block(h, offset);
+
+        add_chunk_size(t.size() | (boost::uint64_t(zero_copy_prelude::handoff)
+                                   << zero_copy_prelude::codec_shift));
+        add_chunk_size(offset);
+
+        handed_off_bytes_ += n;
+        return true;
+    }
+
+    // Encode the elements of a bitwise vector into the arena with the codec,
+    // if there is one and the vector is large and compressible enough.
+    // Returns false if the vector is to be sent as it is.
+    bool encode(
+        void const* data
+      , std::size_t elements
+      , std::size_t element_size
         )
     {
-        // Now we know how large chunk_sizes_ needs to be.
-        chunk_sizes_.resize(chunks_);
+        std::size_t const n = elements * element_size;
 
-        // The second thing we need is the list of chunk sizes. 
-        boost::asio::async_read(*socket_,
-            boost::asio::buffer(chunk_sizes_),
-            boost::bind(&zero_copy_iarchive::handle_read_chunk_sizes<Parcel>,
-                shared_from_this(),
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred,
-                boost::ref(p)));
+        if (!codec_ || n < compression_threshold_)
+            return false;
+
+        std::size_t const bound = codec_->max_encoded_size(n, element_size);
+
+        if (sizing_)
+        {
+            size_.chunks += 2;
+            count(bound, true);
+            return true;
+        }
+
+        if (!compressible(data, n, element_size))
+            return false;
+
+        BOOST_ASSERT(elements <= zero_copy_prelude::elements_mask);
+
+        char* p = arena_.allocate(bound);
+        std::size_t const size = codec_->encode(data, n, element_size, p);
+        arena_.release(bound - size);
+
+        add_chunk_size(elements | (boost::uint64_t(codec_->id())
+                                   << zero_copy_prelude::codec_shift));
+        add_chunk_size(size);
+
+        codec_bytes_in_ += n;
+        codec_bytes_out_ += size;
+
+        checksum_body(p, size);
+
+        // Small fields that follow are copied right behind the encoded bytes.
+        arena_.message().push_back(boost::asio::buffer(p, size));
+        inline_run_ = true;
+        return true;
     }
 
-    template <typename Parcel>
-    void handle_read_chunk_sizes(
-        boost::system::error_code const& e
-      , std::size_t bytes
-      , Parcel& p
+    // Encode a few samples of the n bytes at data, and see if they shrink
+    // enough.
+    bool compressible(
+        void const* data
+      , std::size_t n
+      , std::size_t element_size
         )
     {
-        // First pass. Create the message structure. Note that this doesn't
-        // actually read in anything.
-        pass_ = 1;
+        if (compression_ratio_ >= 1.0)
+            return true;
+
+        char const* const bytes = static_cast<char const*>(data);
+
+        std::size_t sample
+            = (std::min)(n, std::size_t(compression_sample_size));
+        if (sample > element_size)
+            sample -= sample % element_size;
+
+        std::size_t const stride
+            = (n - sample) / (compression_samples - 1) / element_size
+            * element_size;
+
+        codec_scratch_.resize(codec_->max_encoded_size(sample, element_size));
+
+        std::size_t encoded = 0;
+
+        for (std::size_t i = 0; i < compression_samples; ++i)
+            encoded += codec_->encode(bytes + i * stride, sample, element_size
+                                    , &codec_scratch_[0]);
+
+        return double(encoded)
+            <= compression_ratio_ * double(compression_samples * sample);
+    }
+
+    // Add n bytes of arena space to the message and return them. Consecutive
+    // allocations are contiguous in the arena, so they are merged into a
+    // single buffer.
+    char* append_inline(std::size_t n)
+    {
+        std::vector<boost::asio::const_buffer>& message = arena_.message();
+
+        char* p = arena_.allocate(n);
+
+        if (inline_run_)
+        {
+            char const* run = boost::asio::buffer_cast<char const*>(
+                message.back());
+            std::size_t const run_size
+                = boost::asio::buffer_size(message.back());
+
+            if (run + run_size == p)
+            {
+                message.back() = boost::asio::buffer(run, run_size + n);
+                return p;
+            }
+        }
+
+        message.push_back(boost::asio::buffer(p, n));
+        inline_run_ = true;
+        return p;
+    }
+
+    // Synchronously write a data structure to the socket.
+    template <typename Parcel>
+    void write(Parcel const& p)
+    {
+        presize(p);
+
+        begin_message();
+
         *this & p;
 
-        boost::asio::async_read(*socket_, message_,
-            boost::bind(&zero_copy_iarchive::handle_read_message<Parcel>,
-                shared_from_this(),
-                boost::asio::placeholders::error,
-                boost::asio::placeholders::bytes_transferred,
-                boost::ref(p)));
+        end_message(true);
+
+        // Bypass Asio here; it only passes 64 buffers per writev to the
+        // kernel.
+        to_iovecs(arena_.message(), iovecs_);
+
+        native_handle_type const fd = socket_->native_handle();
+        std::size_t sent = 0;
+
+        last_syscalls_ = 0;
+
+        // The prelude, and the size table when it didn't fit into the
+        // prelude.
+        std::size_t const header
+            = (0 == boost::asio::buffer_size(arena_.message().at(1))) ? 1 : 2;
+
+        if (!stripe_ranges_.empty())
+            split_stripes(iovecs_, header, stripe_ranges_, stripe_size_
+                        , stripe_iovecs_);
+
+        if (rendezvous_)
+        {
+            // Announce the message, and wait for the go-ahead.
+            last_syscalls_ += gather_write(fd, &iovecs_[0], header);
+            wait_clear_to_send();
+            sent = header;
+        }
+
+        iovec* const rest = (iovecs_.size() > sent) ? &iovecs_[sent] : 0;
+        std::size_t const count = iovecs_.size() - sent;
+
+        if (!stripe_ranges_.empty())
+            last_syscalls_ += stripe_workers_.transfer(gather_writer(), fd
+                                                     , rest, count
+                                                     , stripe_iovecs_);
+        else if (0 != count)
+            last_syscalls_ += gather_write(fd, rest, count);
+
+        total_syscalls_ += last_syscalls_;
+
+        reset();
     }
 
+    // Asynchronously write a data structure to the socket. p is serialized
+    // right away and queued; h is called once it has been written, or with
+    // the error that stopped the send queue. Whatever is queued when the
+    // socket becomes writable goes out together, in as few writev calls as
+    // possible. Returns false, and does nothing, if send_queue_depth()
+    // messages are already queued.
+    //
+    // NOTE: Large bitwise fields are sent from where they are, so p has to
+    // stay alive and unchanged until h is called; the overloads below take
+    // care of that. Don't mix write() with queued messages. The socket is
+    // non-blocking while messages are queued.
     template <typename Parcel>
-    void handle_read_message(
-        boost::system::error_code const& e
-      , std::size_t bytes
-      , Parcel& p
-        )
+    bool async_write(Parcel const& p, handler_type const& h = handler_type())
     {
-        // Second pass. Do any required deserialization. 
-        pass_ = 2;
+        if (send_queue_.size() >= send_queue_depth_)
+            return false;
+
+        presize(p);
+
+        begin_message();
+
+        // FIXME: Not sure if this is the correct way to kick off the
+        // serialization call chain.
         *this & p;
 
-        if (handler_)
-            handler_();
+        end_message(false);
 
-        message_.clear();
-        chunk_sizes_.clear();
-        chunks_ = 0;
-        current_chunk_ = 0;
-        slow_buffers_.clear();
-        current_slow_buffer_ = 0;
+        queued_message_ptr m = take_message();
+        m->handler = h;
+        send_queue_.push_back(m);
+
+        if (!writing_)
+            wait_writable();
+
+        return true;
     }
-};
+
+    // Asynchronously write a parcel that the archive shares ownership of
+    // until it has been written. h is called with the error code and the
+    // pointer.
+    template <typename Parcel, typename Handler>
+    bool async_write(boost::shared_ptr<Parcel> const& p, Handler const& h)
+    {
+        typedef boost::shared_ptr<Parcel> pointer;
+
+        detail::return_parcel<pointer, Handler> returner(
+            boost::shared_ptr<pointer>(new pointer(p)), h);
+
+        return async_write(*p, handler_type(returner));
+    }
+
+    template <typename Parcel>
+    bool async_write(boost::shared_ptr<Parcel> const& p)
+    {
+        return async_write(p, detail::discard_parcel());
+    }
+
+    // Asynchronously write a parcel that is moved into the archive. h gets
+    // it back once it has been written, so its memory can be reused. If the
+    // send queue is full, p keeps the parcel and false is returned.
+    template <typename Parcel, typename Handler>
+    bool async_write(std::unique_ptr<Parcel>&& p, Handler const& h)
+    {
+        typedef std::unique_ptr<Parcel> pointer;
+
+        boost::shared_ptr<pointer> owner(new pointer(std::move(p)));
+        detail::return_parcel<pointer, Handler> returner(owner, h);
+
+        if (async_write(**owner, handler_type(returner)))
+            return true;
+
+        p = std::move(*owner);
+        return false;
+    }
+
+    template <typename Parcel>
+    bool async_write(std::unique_ptr<Parcel>&& p)
+    {
+        return async_write(std::move(p), detail::discard_parcel());
+    }
+
+    void handle_writable(boost::system::error_code const& e)
+    {
+        boost::system::error_code ec = e;
+
+        if (!ec)
+        {
+            // Hand everything that is queued to the kernel, until it would
+            // block.
+            iovecs_.clear();
+
+            for (std::size_t i = 0; i < send_queue_.size(); ++i)
+                append_iovecs(send_queue_[i]->arena.message(), iovecs_);
+
+            iovec* iov = iovecs_.empty() ? 0 : &iovecs_[0];
+            std::size_t count = iovecs_.size();
+            detail::consume_iovecs(iov, count, sent_);
+
+            std::size_t syscalls = 0;
+
+            try
+            {
+                sent_ += gather_write_some(socket_->native_handle()
+                                         , iov, count, syscalls);
+            }
+            catch (boost::system::system_error const& x)
+            {
+                ec = x.code();
+            }
+
+            total_syscalls_ += syscalls;
+
+            while (!send_queue_.empty() && sent_ >= send_queue_.front()->bytes)
+            {
+                sent_ -= send_queue_.front()->bytes;
+                complete_front(boost::system::error_code());
+            }
+        }
+
+        if (ec)
+        {
+            // Nothing more is going to be written; let everybody know.
+            while (!send_queue_.empty())
+                complete_front(ec);
+            sent_ = 0;
+        }
+
+        // Handlers may have queued more messages.
+        if (!send_queue_.empty())
+        {
+            wait_writable();
+            return;
+        }
+
+        writing_ = false;
+
+        boost::system::error_code ignored;
+        socket_->native_non_blocking(non_blocking_, ignored);
+    }
+
+  private:
+    // Our own writev calls can't block the io_service, so the socket is
+    // non-blocking until the send queue has drained.
+    void wait_writable()
+    {
+        if (!writing_)
+        {
+            non_blocking_ = socket_->native_non_blocking();
+            socket_->native_non_blocking(true);
+        }
+
+        writing_ = true;
+
+        socket_->async_write_some(boost::asio::null_buffers(),
+            boost::bind(&basic_zero_copy_oarchive::handle_writable,
+                this->shared_from_this(),
+                boost::asio::placeholders::error));
+    }
+
+    // Move the message that was just serialized into a queue entry, and take
+    // over the entry's (reset) storage for the next one.
+    queued_message_ptr take_message()
+    {
+        queued_message_ptr m;
+
+        if (free_messages_.empty())
+            m.reset(new queued_message);
+        else
+        {
+            m = free_messages_.back();
+            free_messages_.pop_back();
+        }
+
+        m->arena.swap(arena_);
+        m->slow_buffer.swap(slow_buffer_);
+        m->prelude = prelude_;
+
+        // The first buffer pointed to our prelude.
+        m->arena.message().at(0) = boost::asio::buffer(&m->prelude
+                                                     , sizeof(m->prelude));
+
+        m->bytes = boost::asio::buffer_size(m->arena.message());
+
+        reset();
+
+        return m;
+    }
+
+    void complete_front(boost::system::error_code const& e)
+    {
+        queued_message_ptr m = send_queue_.front();
+        send_queue_.pop_front();
+
+        handler_type h;
+        h.swap(m->handler);
+
+        m->arena.reset();
+        free_messages_.push_back(m);
+
+        if (h)
+            h(e);
+    }
+
+    // Reserve the buffer list, the size table and the arena for p, so that
+    // none of them has to grow while it is serialized. Unless presizing() is
+    // on, the capacity left over from earlier messages has to do.
+    template <typename Parcel>
+    void presize(Parcel const& p)
+    {
+        if (!presizing_)
+        {
+            size_ = zero_copy_size();
+            return;
+        }
+
+        zero_copy_size const size = serialized_size(p);
+        arena_.reserve(size.buffers, size.chunks, size.inline_bytes);
+    }
+
+    void begin_message()
+    {
+        // The first buffer is the prelude. The second buffer holds the chunk
+        // sizes that don't fit into the prelude. We'll fill these in later.
+        std::vector<boost::asio::const_buffer>& message = arena_.message();
+        message.push_back(boost::asio::buffer(&prelude_, sizeof(prelude_)));
+        message.push_back(boost::asio::const_buffer());
+        inline_run_ = false;
+    }
+
+    // Rendezvous and striping are only done by write().
+    void end_message(bool synchronous)
+    {
+        // NOTE: Non-container chunks (e.g. single elements) are not in the size
+        // list.
+        std::vector<boost::asio::const_buffer>& message = arena_.message();
+        std::vector<boost::integer::ulittle64_t>& chunk_sizes
+            = arena_.chunk_sizes();
+
+        if (slow_archive_)
+        {
+            std::size_t const size = slow_streambuf_->size();
+
+            slow_archive_.reset();
+            BOOST_ASSERT(slow_streambuf_->size() == size);
+            slow_streambuf_.reset();
+
+            message.push_back(boost::asio::buffer(&slow_buffer_[0], size));
+            inline_run_ = false;
+            checksum_body(&slow_buffer_[0], size);
+        }
+
+        prelude_.flags
+            = (boost::uint64_t(channel_) << zero_copy_prelude::channel_shift)
+            | (shared_slow_path_ ? zero_copy_prelude::slow_segment : 0);
+
+        if (checksum_)
+        {
+            boost::integer::ulittle64_t trailer = crc_;
+            to_wire_order(&trailer, 1);
+
+            char* p = arena_.allocate(sizeof(trailer));
+            std::memcpy(p, &trailer, sizeof(trailer));
+            message.push_back(boost::asio::buffer(p, sizeof(trailer)));
+            inline_run_ = false;
+
+            prelude_.flags |= zero_copy_prelude::checksum;
+        }
+
+        if (synchronous && !stripes_.empty())
+            add_stripe_ranges();
+
+        std::size_t const chunks = chunk_sizes.size();
+        std::size_t const inlined
+            = (std::min)(chunks, std::size_t(zero_copy_prelude::inline_chunks));
+
+        prelude_.chunks = chunks;
+        std::fill(prelude_.chunk_sizes
+                , prelude_.chunk_sizes + zero_copy_prelude::inline_chunks
+                , boost::integer::ulittle64_t(0));
+        std::copy(chunk_sizes.begin(), chunk_sizes.begin() + inlined
+                , prelude_.chunk_sizes);
+
+        if (chunks > inlined)
+        {
+            to_wire_order(&chunk_sizes[inlined], chunks - inlined);
+            message.at(1) = boost::asio::buffer(&chunk_sizes[inlined]
+              , (chunks - inlined) * sizeof(boost::integer::ulittle64_t));
+        }
+
+        std::size_t body_size = 0;
+        for (std::size_t i = 2; i < message.size(); ++i)
+            body_size += boost::asio::buffer_size(message[i]);
+        prelude_.body_size = body_size;
+
+        rendezvous_ = synchronous && (body_size > rendezvous_threshold_);
+
+        if (rendezvous_)
+        {
+            prelude_.flags |= zero_copy_prelude::rendezvous;
+            ++rendezvous_messages_;
+        }
+        else
+            ++eager_messages_;
+
+        to_wire_order(prelude_);
+    }
+
+    // Stripe the chunks above the stripe threshold, and describe them at the
+    // end of the size table.
+    void add_stripe_ranges()
+    {
+        std::vector<boost::asio::const_buffer>& message = arena_.message();
+        std::vector<boost::integer::ulittle64_t>& chunk_sizes
+            = arena_.chunk_sizes();
+
+        std::size_t offset = 0;
+
+        for (std::size_t i = 2; i < message.size(); ++i)
+        {
+            std::size_t const size = boost::asio::buffer_size(message[i]);
+
+            if (size >= stripe_threshold_ && 0 != size)
+            {
+                stripe_range const r = { offset, size };
+                stripe_ranges_.push_back(r);
+            }
+
+            offset += size;
+        }
+
+        if (stripe_ranges_.empty())
+            return;
+
+        BOOST_ASSERT(stripe_ranges_.size()
+                  <= zero_copy_prelude::stripe_ranges_mask);
+
+        chunk_sizes.push_back(stripe_size_);
+        chunk_sizes.push_back(stripes_.size());
+
+        for (std::size_t r = 0; r < stripe_ranges_.size(); ++r)
+        {
+            chunk_sizes.push_back(stripe_ranges_[r].offset);
+            chunk_sizes.push_back(stripe_ranges_[r].length);
+        }
+
+        prelude_.flags |= boost::uint64_t(stripe_ranges_.size())
+                       << zero_copy_prelude::stripe_ranges_shift;
+    }
+
+    void wait_clear_to_send()
+    {
+        zero_copy_prelude cts;
+
+        read_at_least(socket_->native_handle()
+          , reinterpret_cast<char*>(&cts), sizeof(cts), sizeof(cts)
+          , last_syscalls_);
+
+        // prelude_ is in wire order already.
+        zero_copy_prelude announced = prelude_;
+        to_wire_order(announced);
+
+        zero_copy_prelude expected = clear_to_send_for(announced);
+        to_wire_order(expected);
+
+        if (0 == std::memcmp(&cts, &expected, sizeof(cts)))
+            return;
+
+        reset();
+
+        BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+            boost::archive::archive_exception::input_stream_error
+          , "expected the clear_to_send for the announced message"));
+    }
+
+    void reset()
+    {
+        arena_.reset();
+        prelude_ = zero_copy_prelude();
+        slow_archive_.reset();
+        slow_streambuf_.reset();
+        inline_run_ = false;
+        rendezvous_ = false;
+        stripe_ranges_.clear();
+        crc_ = 0;
+    }
+};
+
+typedef basic_zero_copy_oarchive<boost::asio::ip::tcp::socket>
+    zero_copy_oarchive;
+
+// Note: We must "deserialize" the object BEFORE we read the data, but AFTER
+// we have read the sizes. This allows us to do zero-copy, because we know the
+// layout of the data structure before we call async_read.
+template <typename Stream>
+struct basic_zero_copy_iarchive
+  : boost::enable_shared_from_this<basic_zero_copy_iarchive<Stream> >
+{
+    typedef std::function<void(boost::system::error_code const&)>
+        handler_type;
+    typedef std::function<void(std::size_t)> rendezvous_handler_type;
+
+    typedef boost::mpl::true_ is_loading;
+    typedef boost::mpl::false_ is_saving;
+
+  private:
+    typedef typename Stream::native_handle_type native_handle_type;
+
+    Stream* socket_;
+
+    handler_type handler_;
+
+    rendezvous_handler_type rendezvous_handler_;
+    std::size_t eager_messages_;
+    std::size_t rendezvous_messages_;
+    zero_copy_prelude cts_; ///< The clear_to_send being written.
+    bool cleared_to_send_; ///< For the current message.
+
+    boost::uint64_t max_body_size_;
+    boost::uint64_t layout_left_; ///< Of max_body_size_, in pass 1.
+    boost::uint64_t body_left_; ///< Of the announced body, in pass 1.
+
+    bool homogeneity_; ///< Is it safe to do bitwise serialization? E.g. does
+                       ///  the target have the endianness as us, etc?
+    bool swap_bytes_;  ///< Are bitwise fields byte swapped on the wire?
+    peer_layout peer_; ///< As negotiated with the peer.
+
+    std::size_t pass_; 
+
+    zero_copy_arena<boost::asio::mutable_buffer> arena_;
+    zero_copy_prelude prelude_;
+    std::size_t current_chunk_;
+
+    // Arena buffers that pass 2 copies or decodes into the parcel: coalesced
+    // small fields, slow-path fields and encoded vectors.
+    std::vector<boost::asio::mutable_buffer> copy_buffers_;
+    std::size_t current_copy_buffer_;
+
+    // Vectors whose bytes arrive encoded, in the order of the parcel.
+    struct encoded_chunk
+    {
+        chunk_codec const* codec;
+        void const* data; ///< Where the decoded bytes go.
+        std::size_t size; ///< Decoded.
+        std::size_t element_size;
+    };
+
+    std::vector<encoded_chunk> encoded_chunks_;
+    std::size_t current_encoded_chunk_;
+
+    // Storage of the vectors that adopted a block handed off by the sender,
+    // in the order of the parcel.
+    std::vector<void const*> adopted_chunks_;
+    std::size_t current_adopted_chunk_;
+
+    // The slow segment of the current message, if the sender used one.
+    bool shared_slow_path_;
+    std::size_t slow_segment_size_;
+    boost::asio::mutable_buffer slow_segment_;
+    boost::scoped_ptr<array_streambuf> slow_streambuf_;
+    boost::scoped_ptr<portable_binary_iarchive> slow_archive_;
+
+    std::size_t gather_threshold_;
+    bool inline_run_;
+
+    std::vector<iovec> iovecs_;
+    std::size_t last_syscalls_;
+    std::size_t total_syscalls_;
+
+    // Per-connection staging buffer. The prelude, the overflow chunk sizes and
+    // the leading bytes of the body are read into it in one go. Bytes past the
+    // end of the current message stay here for the next call to read.
+    std::vector<char> staging_;
+    std::size_t staging_begin_;
+    std::size_t staging_end_;
+
+    // State of the receive loop; see receive().
+    struct channel_sink;
+    typedef boost::shared_ptr<channel_sink> channel_sink_ptr;
+    typedef std::map<boost::uint32_t, channel_sink_ptr> channel_map;
+
+    bool receiving_;
+    bool body_pending_;
+    channel_sink_ptr default_sink_;
+    channel_map channels_;
+    channel_sink_ptr current_sink_;
+    std::size_t dropped_messages_;
+    std::size_t discard_; ///< Bytes of a dropped body still to be read.
+
+    boost::uint32_t channel_; ///< Channel of the current message.
+    bool owns_socket_;
+
+    std::vector<Stream*> stripes_;
+    stripe_workers<native_handle_type> stripe_workers_;
+    std::vector<stripe_range> stripe_ranges_; ///< Of the current message.
+    std::vector<std::vector<iovec> > stripe_iovecs_;
+    std::vector<std::vector<boost::asio::mutable_buffer> > stripe_buffers_;
+
+    // The whole body of the current message, if it carries a checksum; the
+    // last buffer is the checksum.
+    std::vector<boost::asio::mutable_buffer> checksum_buffers_;
+    std::size_t checksum_failures_;
+
+  public:
+    BOOST_STATIC_CONSTANT(std::size_t, default_staging_size = 4096);
+    BOOST_STATIC_CONSTANT(std::size_t, drop_scratch_size
+                                     = std::size_t(1) << 20);
+    BOOST_STATIC_CONSTANT(boost::uint64_t, default_max_body_size
+                                         = boost::uint64_t(4) << 30);
+
+    basic_zero_copy_iarchive(
+        Stream& socket 
+      , bool homogeneity = false
+      , std::size_t staging_size = default_staging_size
+        )
+      : socket_(&socket)
+      , handler_()
+      , rendezvous_handler_()
+      , eager_messages_(0)
+      , rendezvous_messages_(0)
+      , cts_()
+      , cleared_to_send_(false)
+      , max_body_size_(default_max_body_size)
+      , layout_left_(0)
+      , body_left_(0)
+      , homogeneity_(homogeneity)
+      , swap_bytes_(false)
+      , peer_(homogeneity ? homogeneous_peer : heterogeneous_peer)
+      , pass_(0)
+      , arena_()
+      , prelude_()
+      , current_chunk_(0)
+      , copy_buffers_()
+      , current_copy_buffer_(0)
+      , encoded_chunks_()
+      , current_encoded_chunk_(0)
+      , adopted_chunks_()
+      , current_adopted_chunk_(0)
+      , shared_slow_path_(false)
+      , slow_segment_size_(0)
+      , slow_segment_()
+      , slow_streambuf_()
+      , slow_archive_()
+      , gather_threshold_(zero_copy_oarchive::default_gather_threshold)
+      , inline_run_(false)
+      , iovecs_()
+      , last_syscalls_(0)
+      , total_syscalls_(0)
+      , staging_((std::max)(staging_size, sizeof(zero_copy_prelude)))
+      , staging_begin_(0)
+      , staging_end_(0)
+      , receiving_(false)
+      , body_pending_(false)
+      , default_sink_()
+      , channels_()
+      , current_sink_()
+      , dropped_messages_(0)
+      , discard_(0)
+      , channel_(0)
+      , owns_socket_(true)
+      , stripes_()
+      , stripe_workers_()
+      , stripe_ranges_()
+      , stripe_iovecs_()
+      , stripe_buffers_()
+      , checksum_buffers_()
+      , checksum_failures_(0)
+    {}
+
+    ~basic_zero_copy_iarchive()
+    {
+        if (!owns_socket_)
+            return;
+
+        close_stream(*socket_);
+    }
+
+    // Whether the socket is shut down and closed along with the archive.
+    // Turn this off if the socket is shared with other archives.
+    bool owns_socket() const
+    {
+        return owns_socket_;
+    }
+
+    void owns_socket(bool o)
+    {
+        owns_socket_ = o;
+    }
+
+    // The channel of the last message read.
+    boost::uint32_t channel() const
+    {
+        return channel_;
+    }
+
+    // Whether fields are serialized bitwise. Set this from the result of
+    // negotiate_homogeneity() once the connection is established; until
+    // then everything takes the slow path.
+    bool homogeneity() const
+    {
+        return homogeneity_;
+    }
+
+    void homogeneity(bool h)
+    {
+        homogeneity_ = h;
+    }
+
+    // Whether bitwise fields are converted between host order and the little
+    // endian wire order. Only big endian hosts ever need this.
+    bool swap_bytes() const
+    {
+        return swap_bytes_;
+    }
+
+    void swap_bytes(bool s)
+    {
+        swap_bytes_ = s;
+    }
+
+    // Configure bitwise serialization from the result of
+    // negotiate_peer_layout(). With a byte_swapped_peer, only the big endian
+    // end swaps bytes, but both ends send the bitwise leaves that can't be
+    // swapped (see is_byte_swappable) down the slow path.
+    peer_layout peer() const
+    {
+        return peer_;
+    }
+
+    void peer(peer_layout layout)
+    {
+        peer_ = layout;
+        homogeneity_ = (heterogeneous_peer != layout);
+#if defined(BOOST_BIG_ENDIAN)
+        swap_bytes_ = (byte_swapped_peer == layout);
+#else
+        swap_bytes_ = false;
+#endif
+    }
+
+    // Whether the peer has the other endianness.
+    bool byte_swapped() const
+    {
+        return swap_bytes_ || (byte_swapped_peer == peer_);
+    }
+
+    // Number of bytes held by this connection's arena.
+    std::size_t arena_bytes() const
+    {
+        return arena_.reserved_bytes();
+    }
+
+    // Fields of at most this many bytes are read into the arena and copied
+    // out in pass 2, so that they share one buffer in the scatter read. This
+    // doesn't change the wire format, so it needn't match the sender.
+    std::size_t gather_threshold() const
+    {
+        return gather_threshold_;
+    }
+
+    void gather_threshold(std::size_t bytes)
+    {
+        gather_threshold_ = bytes;
+    }
+
+    // Add a connection that the sender stripes large chunks over, in the
+    // order the sender added them (see zero_copy_oarchive::add_stripe()).
+    // Each stripe is read straight into the parcel, by a worker thread of
+    // its own in read(), and by an asynchronous read of its own otherwise.
+    void add_stripe(Stream& s)
+    {
+        stripes_.push_back(&s);
+        stripe_workers_.add(s.native_handle());
+    }
+
+    std::size_t stripes() const
+    {
+        return stripes_.size();
+    }
+
+    // Called with the body size of each rendezvous message (see
+    // zero_copy_oarchive::rendezvous_threshold()) before the parcel is laid
+    // out for it. None of the body has been sent yet; it may block until
+    // there is room for it.
+    void rendezvous_handler(rendezvous_handler_type const& h)
+    {
+        rendezvous_handler_ = h;
+    }
+
+    // Largest body a message may announce, and the most the vectors of a
+    // parcel may be resized to in all while it is laid out. Both are checked
+    // before any memory is allocated for the message, and before a rendezvous
+    // message is cleared to send; every receive path throws archive_exception
+    // for a message that goes over.
+    boost::uint64_t max_body_size() const
+    {
+        return max_body_size_;
+    }
+
+    void max_body_size(boost::uint64_t bytes)
+    {
+        max_body_size_ = bytes;
+    }
+
+    // Number of messages whose body didn't match its checksum (see
+    // zero_copy_oarchive::checksum()). The receive loop drops them; read()
+    // throws, and async_read() passes checksum_mismatch() to its handler.
+    std::size_t checksum_failures() const
+    {
+        return checksum_failures_;
+    }
+
+    // The error async_read() reports for a message whose body didn't match
+    // its checksum.
+    static boost::system::error_code checksum_mismatch()
+    {
+        return boost::system::errc::make_error_code(
+            boost::system::errc::illegal_byte_sequence);
+    }
+
+    // Number of messages whose body was sent right away.
+    std::size_t eager_messages() const
+    {
+        return eager_messages_;
+    }
+
+    // Number of messages whose body was sent on our go-ahead.
+    std::size_t rendezvous_messages() const
+    {
+        return rendezvous_messages_;
+    }
+
+    // Number of system calls made by the last call to read().
+    std::size_t last_syscalls() const
+    {
+        return last_syscalls_;
+    }
+
+    // Number of system calls made by all calls to read().
+    std::size_t total_syscalls() const
+    {
+        return total_syscalls_;
+    }
+
+    template <typename T>
+    basic_zero_copy_iarchive& operator& (T& t)
+    {
+        dispatch(t);
+        return *this;
+    }
+
+    template <typename T>
+    basic_zero_copy_iarchive& operator>> (T& t)
+    {
+        dispatch(t);
+        return *this;
+    }
+
+    template <typename T>
+    basic_zero_copy_iarchive& operator& (boost::serialization::nvp<T> const& t)
+    {
+        dispatch(t.value());
+        return *this;
+    }
+
+    template <typename T>
+    basic_zero_copy_iarchive& operator>> (boost::serialization::nvp<T> const& t)
+    {
+        dispatch(t.value());
+        return *this;
+    }
+
+    // The rest of the Boost.Serialization archive interface.
+    template <typename T>
+    void register_type(T const* = 0) {}
+
+    boost::archive::library_version_type get_library_version() const
+    {
+        return boost::archive::BOOST_ARCHIVE_VERSION();
+    }
+
+    void reset_object_address(void const*, void const*) {}
+
+    void load_binary(void* address, std::size_t count)
+    {
+        if (1 == pass_)
+            scatter(address, count);
+        else if (2 == pass_)
+            gather(address, count);
+        else
+            BOOST_ASSERT(false);
+    }
+
+    template <typename T>
+    void dispatch(T& t)
+    {
+        dispatch(t, typename is_zero_copy_traversable<T>::type());
+    }
+
+    template <typename T>
+    void dispatch(T& t, boost::mpl::true_)
+    {
+        traverse(t);
+    }
+
+    // Walk a user class field by field. This happens in both passes.
+    template <typename T>
+    void traverse(T& t)
+    {
+        boost::serialization::serialize_adl(*this, t
+          , boost::serialization::version<T>::value);
+    }
+
+    template <typename T, typename Allocator>
+    void traverse(std::vector<T, Allocator>& t)
+    {
+        // Pass 1 sizes the outer vector from the size list; the elements then
+        // size themselves before the scatter read is posted.
+        if (1 == pass_)
+        {
+            boost::uint64_t const size
+                = arena_.chunk_sizes().at(current_chunk_++);
+
+            claim_layout(size, sizeof(T));
+            t.resize(std::size_t(size));
+        }
+
+        for (std::size_t i = 0; i < t.size(); ++i)
+            dispatch(t[i]);
+    }
+
+    template <typename T>
+    void dispatch(T& t, boost::mpl::false_)
+    {
+        leaf(t, typename is_bitwise_serializable<T>::type());
+    }
+
+    template <typename T>
+    void leaf(T& t, boost::mpl::true_)
+    {
+        typedef typename is_byte_swappable<T>::type swappable;
+
+        if (!homogeneity_ || (byte_swapped() && !swappable::value))
+        {
+            leaf(t, boost::mpl::false_());
+            return;
+        }
+
+        // Pass 1 builds the structure of the message. It is done right before
+        // the message is read.
+        if (1 == pass_)
+            load_pass1<T>::call(this, t);
+
+        // Pass 2 decodes the message after it has been read.
+        else if (2 == pass_)
+        {
+            load_pass2<T>::call(this, t);
+
+            if (swap_bytes_)
+                swap_loaded(t, swappable());
+        }
+
+        else
+            BOOST_ASSERT(false);
+    }
+
+    template <typename T>
+    void swap_loaded(T& t, boost::mpl::true_)
+    {
+        byte_swap_inplace(&t, 1);
+    }
+
+    template <typename T, typename Allocator>
+    void swap_loaded(std::vector<T, Allocator>& t, boost::mpl::true_)
+    {
+        if (!t.empty())
+            byte_swap_inplace(&t[0], t.size());
+    }
+
+    template <typename T>
+    void swap_loaded(T&, boost::mpl::false_) {}
+
+    template <typename T>
+    void leaf(T& t, boost::mpl::false_)
+    {
+        if (1 == pass_)
+            slow_load_pass1(t);
+        else if (2 == pass_)
+            slow_load_pass2(t);
+        else
+            BOOST_ASSERT(false);
+    }
+
+    template <typename T>
+    struct load_pass1
+    {
+        static void call(basic_zero_copy_iarchive* self, T& t)
+        {
+            self->scatter(&t, sizeof(T));
+        } 
+    };
+
+    // This specialization has to be done not just for std::vector, but for
+    // other special cases of boost::asio::buffer, such as boost::array,
+    // std::array, perhaps std::valarray too.
+    template <typename T, typename Allocator>
+    struct load_pass1<std::vector<T, Allocator> >
+    {
+        static void call(
+            basic_zero_copy_iarchive* self
+          , std::vector<T, Allocator>& t
+            )
+        {
+            // Use the size list to figure out how large this vector needs to
+            // be. The elements are about to be overwritten by the read, so
+            // with a default_init_allocator they are left uninitialized.
+            boost::uint64_t const entry
+                = self->arena_.chunk_sizes().at(self->current_chunk_++);
+            boost::uint64_t const size
+                = entry & zero_copy_prelude::elements_mask;
+            boost::uint8_t const codec
+                = boost::uint8_t(entry >> zero_copy_prelude::codec_shift);
+
+            if (zero_copy_prelude::handoff == codec)
+            {
+                self->adopt(t, size);
+                return;
+            }
+
+            // The bytes of a vector that isn't encoded are part of the body.
+            if (0 == codec && size > self->body_left_ / sizeof(T))
+                self->layout_error();
+
+            self->claim_layout(size, sizeof(T));
+            t.resize(std::size_t(size));
+
+            if (t.empty())
+                return;
+
+            if (0 != codec)
+                self->scatter_encoded(codec, &t[0], t.size() * sizeof(T)
+                                    , sizeof(T));
+            else
+                self->scatter(&t[0], t.size() * sizeof(T));
+        } 
+    };
+
+    // This specialization has to be done not just for std::vector, but for
+    // other special cases of boost::asio::buffer, such as boost::array,
+    // std::array, perhaps std::valarray too. For this pass, the general case
+    // (no-op) also works for std::vector, etc.
+    template <typename T>
+    struct load_pass2
+    {
+        static void call(basic_zero_copy_iarchive* self, T& t)
+        {
+            // Only coalesced fields need any work.
+            self->gather(&t, sizeof(T));
+        }
+    };
+
+    template <typename T, typename Allocator>
+    struct load_pass2<std::vector<T, Allocator> >
+    {
+        static void call(
+            basic_zero_copy_iarchive* self
+          , std::vector<T, Allocator>& t
+            )
+        {
+            if (   !t.empty()
+                && !self->decode(&t[0])
+                && !self->adopted(&t[0]))
+                self->gather(&t[0], t.size() * sizeof(T));
+        }
+    };
+
+    template <typename T>
+    void slow_load_pass1(T& t)
+    {
+        // In the slow segment, the size list has the offset of the end of the
+        // field; the segment is read after everything else.
+        if (shared_slow_path_)
+        {
+            boost::uint64_t const end
+                = arena_.chunk_sizes().at(current_chunk_++);
+
+            // add_slow_segment() takes it out of the body.
+            if (end > body_left_)
+                layout_error();
+
+            slow_segment_size_ = std::size_t(end);
+        }
+
+        // Use the size list to figure out how large this buffer has to be.
+        else
+            copy_inline(arena_.chunk_sizes().at(current_chunk_++));
+    }
+
+    template <typename T>
+    void slow_load_pass2(T& t)
+    {
+        if (shared_slow_path_)
+        {
+            // One archive decodes all slow fields of the message, in order.
+            if (!slow_archive_)
+            {
+                slow_streambuf_.reset(new array_streambuf(
+                    boost::asio::buffer_cast<char const*>(slow_segment_)
+                  , boost::asio::buffer_size(slow_segment_)));
+                slow_archive_.reset(new portable_binary_iarchive(
+                    *slow_streambuf_, boost::archive::no_codecvt));
+            }
+
+            *slow_archive_ & t;
+            return;
+        }
+
+        boost::asio::mutable_buffer const& slow_buffer_
+            = copy_buffers_.at(current_copy_buffer_++);
+
+        array_streambuf buffer(
+            boost::asio::buffer_cast<char const*>(slow_buffer_)
+          , boost::asio::buffer_size(slow_buffer_));
+
+        {
+            // Deserialize t the slow way.
+            portable_binary_iarchive archive(buffer, boost::archive::no_codecvt);
+            archive & t;
+        }
+    }
+
+    // Pass 1: count a vector of n elements of element_size bytes, or an
+    // arena reservation of n bytes, against max_body_size(), before the
+    // memory is taken.
+    void claim_layout(boost::uint64_t n, std::size_t element_size)
+    {
+        if (n > layout_left_ / element_size)
+            layout_error();
+
+        layout_left_ -= n * element_size;
+    }
+
+    // Pass 1: take n bytes of the announced body.
+    void claim_body(boost::uint64_t n)
+    {
+        if (n > body_left_)
+            layout_error();
+
+        body_left_ -= n;
+    }
+
+    void layout_error()
+    {
+        reset();
+
+        BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+            boost::archive::archive_exception::input_stream_error
+          , "message larger than max_body_size() or its announced body"));
+    }
+
+    // Pass 1: have the scatter read place n bytes at data. Small fields are
+    // read into the arena instead (see gather()).
+    void scatter(void* data, std::size_t n)
+    {
+        if (n > gather_threshold_)
+        {
+            claim_body(n);
+
+            arena_.message().push_back(boost::asio::buffer(data, n));
+            inline_run_ = false;
+        }
+
+        else
+            copy_inline(n);
+    }
+
+    // Pass 2: copy a field that scatter() placed in the arena to data.
+    void gather(void* data, std::size_t n)
+    {
+        if (n > gather_threshold_)
+            return;
+
+        boost::asio::mutable_buffer const& b
+            = copy_buffers_.at(current_copy_buffer_++);
+        BOOST_ASSERT(boost::asio::buffer_size(b) == n);
+
+        std::memcpy(data, boost::asio::buffer_cast<void const*>(b), n);
+    }
+
+    // Pass 1: read the encoded bytes of a vector into the arena; pass 2
+    // decodes them to data.
+    void scatter_encoded(
+        boost::uint8_t codec
+      , void* data
+      , std::size_t n
+      , std::size_t element_size
+        )
+    {
+        encoded_chunk c = {
+            chunk_codecs::instance().find(codec).get(), data, n, element_size
+        };
+
+        if (!c.codec)
+        {
+            reset();
+
+            BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+                boost::archive::archive_exception::input_stream_error
+              , "unknown chunk codec"));
+        }
+
+        encoded_chunks_.push_back(c);
+        copy_inline(arena_.chunk_sizes().at(current_chunk_++));
+    }
+
+    // Pass 1: make the block that the sender handed off the storage of t
+    // (see zero_copy_oarchive::hand_off()). Nothing of it is in the body.
+    template <typename T, typename Allocator>
+    void adopt(std::vector<T, Allocator>& t, boost::uint64_t size)
+    {
+        boost::uint64_t const offset
+            = arena_.chunk_sizes().at(current_chunk_++);
+
+        if (!adopt_block(socket_->native_handle(), t, std::size_t(size)
+                       , offset))
+        {
+            reset();
+
+            BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+                boost::archive::archive_exception::input_stream_error
+              , "cannot adopt a handed off chunk"));
+        }
+
+        adopted_chunks_.push_back(&t[0]);
+    }
+
+    // Pass 2: returns true if the vector at data was adopted, and so is
+    // already complete.
+    bool adopted(void const* data)
+    {
+        if (   current_adopted_chunk_ == adopted_chunks_.size()
+            || adopted_chunks_[current_adopted_chunk_] != data)
+            return false;
+
+        ++current_adopted_chunk_;
+        return true;
+    }
+
+    // Pass 2: decode a vector that scatter_encoded() read. Returns false if
+    // the vector at data wasn't encoded.
+    bool decode(void* data)
+    {
+        if (   current_encoded_chunk_ == encoded_chunks_.size()
+            || encoded_chunks_[current_encoded_chunk_].data != data)
+            return false;
+
+        encoded_chunk const& c = encoded_chunks_[current_encoded_chunk_++];
+
+        boost::asio::mutable_buffer const& b
+            = copy_buffers_.at(current_copy_buffer_++);
+
+        if (!c.codec->decode(boost::asio::buffer_cast<char const*>(b)
+              , boost::asio::buffer_size(b), c.element_size, data, c.size))
+            BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+                boost::archive::archive_exception::input_stream_error
+              , "corrupt encoded chunk"));
+
+        return true;
+    }
+
+    // Reserve n bytes in the arena for pass 2. Consecutive reservations are
+    // contiguous in the arena, so they are merged into a single buffer.
+    void copy_inline(boost::uint64_t n)
+    {
+        claim_body(n);
+        claim_layout(n, 1);
+
+        std::vector<boost::asio::mutable_buffer>& message = arena_.message();
+
+        char* p = arena_.allocate(n);
+        copy_buffers_.push_back(boost::asio::buffer(p, n));
+
+        if (inline_run_)
+        {
+            char* run = boost::asio::buffer_cast<char*>(message.back());
+            std::size_t const run_size
+                = boost::asio::buffer_size(message.back());
+
+            if (run + run_size == p)
+            {
+                message.back() = boost::asio::buffer(run, run_size + n);
+                return;
+            }
+        }
+
+        message.push_back(boost::asio::buffer(p, n));
+        inline_run_ = true;
+    }
+
+    // Synchronously read a data structure from the socket. Messages on
+    // channels other than 0 are skipped (see dropped_messages()).
+    template <typename Parcel>
+    void read(Parcel& p)
+    {
+        last_syscalls_ = 0;
+
+        for (;;)
+        {
+            skip_body();
+
+            // The prelude, the chunk sizes that didn't fit into it and as much
+            // of the body as has already arrived are picked up with one read.
+            fill_staging(sizeof(zero_copy_prelude));
+
+            // Now we know how large the size table needs to be. If the size
+            // table overflowed the prelude, the rest of it is normally already
+            // staged.
+            fill_staging(read_prelude());
+
+            read_chunk_sizes();
+            announce();
+
+            if (0 == channel_)
+                break;
+
+            bool const striped = drop_message();
+            clear_to_send();
+
+            if (striped)
+                read_body(true);
+
+            reset();
+        }
+
+        // First pass. Create the message structure. Note that this doesn't
+        // actually read in anything.
+        pass_ = 1;
+        *this & p;
+        add_slow_segment();
+        add_checksum();
+        clear_to_send();
+
+        // Striped chunks don't come over the main connection.
+        bool const striped = take_stripes();
+
+        // Copy out whatever part of the body is already staged; only the
+        // remaining (large) chunks are scatter-read from the socket.
+        drain_staging();
+
+        read_body(striped);
+
+        total_syscalls_ += last_syscalls_;
+
+        verify_checksum();
+
+        // Second pass. Do any required deserialization. 
+        pass_ = 2;
+        *this & p;
+
+        reset();
+    }
+ 
+    // Asynchronously read a data structure from the socket. h is called
+    // once p has been loaded, or with the error that stopped the read.
+    template <typename Parcel>
+    void async_read(Parcel& p, handler_type const& h = handler_type())
+    {
+        handler_ = h;
+        start_read(p);
+    }
+
+    template <typename Parcel>
+    void start_read(Parcel& p)
+    {
+        // Finish skipping the body of a message on another channel first.
+        discard_staged();
+
+        if (0 != discard_)
+        {
+            socket_->async_read_some(prepare_staging(staged_header_size()),
+                boost::bind(&basic_zero_copy_iarchive::handle_skip<Parcel>,
+                    this->shared_from_this(),
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred,
+                    boost::ref(p)));
+            return;
+        }
+
+        // The first thing we need is the prelude, which tells us how large the
+        // size table is. We grab as much as the staging buffer can hold.
+        std::size_t const needed = staging_shortfall(sizeof(zero_copy_prelude));
+
+        boost::asio::async_read(*socket_,
+            prepare_staging(sizeof(zero_copy_prelude)),
+            boost::asio::transfer_at_least(needed),
+            boost::bind(&basic_zero_copy_iarchive::handle_read_prelude<Parcel>,
+                this->shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred,
+                boost::ref(p)));
+    }
+
+    template <typename Parcel>
+    void handle_read_prelude(
+        boost::system::error_code const& e,
+        std::size_t bytes,
+        Parcel& p
+        )
+    {
+        staging_end_ += bytes;
+
+        if (e)
+        {
+            complete_read(e);
+            return;
+        }
+
+        // Now we know how large the size table needs to be. The second thing we
+        // need is the part of the size table that didn't fit into the prelude;
+        // if it is already staged this completes without touching the socket.
+        std::size_t const overflow = read_prelude();
+        std::size_t const needed = staging_shortfall(overflow);
+
+        boost::asio::async_read(*socket_,
+            prepare_staging(overflow),
+            boost::asio::transfer_at_least(needed),
+            boost::bind(
+                &basic_zero_copy_iarchive::handle_read_chunk_sizes<Parcel>,
+                this->shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred,
+                boost::ref(p)));
+    }
+
+    template <typename Parcel>
+    void handle_skip(
+        boost::system::error_code const& e
+      , std::size_t bytes
+      , Parcel& p
+        )
+    {
+        staging_end_ += bytes;
+
+        if (e)
+        {
+            complete_read(e);
+            return;
+        }
+
+        reset();
+        start_read(p);
+    }
+
+    template <typename Parcel>
+    void handle_read_chunk_sizes(
+        boost::system::error_code const& e
+      , std::size_t bytes
+      , Parcel& p
+        )
+    {
+        staging_end_ += bytes;
+
+        if (e)
+        {
+            complete_read(e);
+            return;
+        }
+
+        read_chunk_sizes();
+        announce();
+
+        // Messages on other channels are skipped.
+        if (0 != channel_)
+        {
+            if (drop_message() || awaiting_clear_to_send())
+                async_read_body(boost::bind(
+                    &basic_zero_copy_iarchive::handle_skip<Parcel>,
+                    this->shared_from_this(), boost::asio::placeholders::error,
+                    std::size_t(0), boost::ref(p)));
+            else
+            {
+                reset();
+                start_read(p);
+            }
+            return;
+        }
+
+        // First pass. Create the message structure. Note that this doesn't
+        // actually read in anything.
+        pass_ = 1;
+        *this & p;
+        add_slow_segment();
+        add_checksum();
+
+        take_stripes();
+        drain_staging();
+
+        async_read_body(boost::bind(
+            &basic_zero_copy_iarchive::handle_read_message<Parcel>,
+            this->shared_from_this(), boost::asio::placeholders::error,
+            std::size_t(0), boost::ref(p)));
+    }
+
+    template <typename Parcel>
+    void handle_read_message(
+        boost::system::error_code const& e
+      , std::size_t bytes
+      , Parcel& p
+        )
+    {
+        if (e)
+        {
+            complete_read(e);
+            return;
+        }
+
+        // The message has been read completely, so the connection stays
+        // usable.
+        if (!checksum_matches())
+        {
+            ++checksum_failures_;
+            complete_read(checksum_mismatch());
+            return;
+        }
+
+        // Second pass. Do any required deserialization. 
+        pass_ = 2;
+        *this & p;
+
+        complete_read(e);
+    }
+
+    // Receive messages into p until stop_receiving() is called or the
+    // connection fails, calling d(p) for each of them; h is called with the
+    // error, if any, when the loop has ended. One read into the staging
+    // buffer is kept outstanding, and every message that has completely
+    // arrived in it is decoded without going back to the socket, so small
+    // messages cost neither a system call nor a handler of their own. Large
+    // chunks are still read straight into p. Give the archive a large staging
+    // buffer for this.
+    //
+    // Messages on a channel opened with open_channel() go to that channel
+    // instead; p and d get all others.
+    // NOTE: p is reused for every message and has to stay alive until h is
+    // called. Don't mix this with read() or async_read().
+    template <typename Parcel, typename Dispatcher>
+    void receive(
+        Parcel& p
+      , Dispatcher const& d
+      , handler_type const& h = handler_type()
+        )
+    {
+        default_sink_ = make_sink(p, d);
+        start_receiving(h);
+    }
+
+    // Like receive(), but only for the channels opened with open_channel().
+    // Messages on any other channel are read and dropped.
+    void receive_channels(handler_type const& h = handler_type())
+    {
+        default_sink_.reset();
+        start_receiving(h);
+    }
+
+    // Have the receive loop load the messages on channel c (see
+    // zero_copy_oarchive::channel()) into p, and call d(p) for each of them.
+    // Every channel can have a parcel type of its own. Channels can be opened
+    // and closed at any time, also from a dispatcher.
+    template <typename Parcel, typename Dispatcher>
+    void open_channel(boost::uint32_t c, Parcel& p, Dispatcher const& d)
+    {
+        channels_[c] = make_sink(p, d);
+    }
+
+    void close_channel(boost::uint32_t c)
+    {
+        channels_.erase(c);
+    }
+
+    // End the receive loop once the current message has been dispatched.
+    // Can be called from the dispatcher.
+    void stop_receiving()
+    {
+        receiving_ = false;
+    }
+
+    bool receiving() const
+    {
+        return receiving_;
+    }
+
+    // Number of messages the receive loop dropped because nobody was
+    // listening on their channel, and that read() and async_read() skipped
+    // because they weren't on channel 0. The bodies of dropped messages are
+    // read through the staging buffer, and never stored.
+    std::size_t dropped_messages() const
+    {
+        return dropped_messages_;
+    }
+
+    void handle_receive_staging(
+        boost::system::error_code const& e
+      , std::size_t bytes
+        )
+    {
+        staging_end_ += bytes;
+
+        if (e)
+            end_receiving(e);
+        else
+            receive_messages();
+    }
+
+    void handle_receive_body(boost::system::error_code const& e)
+    {
+        if (e)
+            end_receiving(e);
+        else
+            receive_messages();
+    }
+
+  private:
+    // Where the receive loop puts the messages of a channel.
+    struct channel_sink
+    {
+        std::function<void()> load;     ///< Runs the current pass over the
+                                        ///  parcel.
+        std::function<void()> dispatch; ///< Hands the loaded parcel over.
+    };
+
+    template <typename Parcel>
+    struct load_parcel
+    {
+        basic_zero_copy_iarchive* self;
+        Parcel* parcel;
+
+        void operator()()
+        {
+            *self & *parcel;
+        }
+    };
+
+    template <typename Parcel, typename Dispatcher>
+    struct dispatch_parcel
+    {
+        Parcel* parcel;
+        Dispatcher dispatcher;
+
+        void operator()()
+        {
+            dispatcher(*parcel);
+        }
+    };
+
+    template <typename Parcel, typename Dispatcher>
+    channel_sink_ptr make_sink(Parcel& p, Dispatcher const& d)
+    {
+        load_parcel<Parcel> load = { this, &p };
+        dispatch_parcel<Parcel, Dispatcher> dispatch = { &p, d };
+
+        channel_sink_ptr sink(new channel_sink);
+        sink->load = load;
+        sink->dispatch = dispatch;
+        return sink;
+    }
+
+    void start_receiving(handler_type const& h)
+    {
+        BOOST_ASSERT(!receiving_);
+
+        handler_ = h;
+        receiving_ = true;
+        body_pending_ = false;
+
+        receive_messages();
+    }
+
+    void receive_messages()
+    {
+        // The body of the current message has just been read.
+        if (body_pending_)
+        {
+            body_pending_ = false;
+            finish_message();
+        }
+
+        for (;;)
+        {
+            discard_staged();
+
+            if (!receiving_ || 0 != discard_ || !header_staged())
+                break;
+
+            read_prelude();
+            read_chunk_sizes();
+            announce();
+
+            // The sink is held on to, so that the channel can be closed
+            // while the message is in flight.
+            typename channel_map::const_iterator it
+                = channels_.find(channel_);
+            current_sink_
+                = (channels_.end() != it) ? it->second : default_sink_;
+
+            bool striped = false;
+
+            if (current_sink_)
+            {
+                pass_ = 1;
+                current_sink_->load();
+                add_slow_segment();
+                add_checksum();
+
+                striped = take_stripes();
+                drain_staging();
+            }
+
+            else
+                striped = drop_message();
+
+            // The rest of the body hasn't arrived yet; read it in place.
+            if (   striped || awaiting_clear_to_send()
+                || !arena_.message().empty())
+            {
+                body_pending_ = true;
+
+                async_read_body(boost::bind(
+                    &basic_zero_copy_iarchive::handle_receive_body,
+                    this->shared_from_this(),
+                    boost::asio::placeholders::error));
+                return;
+            }
+
+            finish_message();
+        }
+
+        if (!receiving_)
+        {
+            end_receiving(boost::system::error_code());
+            return;
+        }
+
+        // Read as much as fits into the staging buffer, but come back as soon
+        // as anything has arrived.
+        boost::asio::mutable_buffers_1 free
+            = prepare_staging(staged_header_size());
+
+        socket_->async_read_some(free,
+            boost::bind(&basic_zero_copy_iarchive::handle_receive_staging,
+                this->shared_from_this(),
+                boost::asio::placeholders::error,
+                boost::asio::placeholders::bytes_transferred));
+    }
+
+    void finish_message()
+    {
+        channel_sink_ptr sink;
+        sink.swap(current_sink_);
+
+        // A dropped message that was striped.
+        if (!sink)
+        {
+            reset();
+            return;
+        }
+
+        if (!checksum_matches())
+        {
+            ++checksum_failures_;
+            reset();
+            return;
+        }
+
+        pass_ = 2;
+        sink->load();
+
+        reset();
+
+        sink->dispatch();
+    }
+
+    void end_receiving(boost::system::error_code const& e)
+    {
+        receiving_ = false;
+        body_pending_ = false;
+        current_sink_.reset();
+
+        if (handler_)
+            handler_(e);
+    }
+
+    // Hand the outcome of async_read() to its handler, which may start the
+    // next read.
+    void complete_read(boost::system::error_code const& e)
+    {
+        reset();
+
+        handler_type h;
+        h.swap(handler_);
+
+        if (h)
+            h(e);
+    }
+
+    // The number of bytes of the prelude and the size table of the next
+    // message, as far as can be told from what is staged.
+    std::size_t staged_header_size() const
+    {
+        if (staged() < sizeof(zero_copy_prelude))
+            return sizeof(zero_copy_prelude);
+
+        zero_copy_prelude prelude;
+        std::memcpy(&prelude, &staging_[0] + staging_begin_, sizeof(prelude));
+        to_wire_order(prelude);
+
+        std::size_t const chunks = std::size_t(prelude.chunks);
+        std::size_t const inlined = (std::min)(chunks
+          , std::size_t(zero_copy_prelude::inline_chunks));
+
+        return sizeof(zero_copy_prelude)
+             + (chunks - inlined) * sizeof(boost::integer::ulittle64_t);
+    }
+
+    bool header_staged() const
+    {
+        return staged() >= sizeof(zero_copy_prelude)
+            && staged() >= staged_header_size();
+    }
+
+    std::size_t staged() const
+    {
+        return staging_end_ - staging_begin_;
+    }
+
+    std::size_t staging_shortfall(std::size_t n) const
+    {
+        return (n > staged()) ? (n - staged()) : 0;
+    }
+
+    // Make sure at least n bytes fit behind staging_begin_, and return the
+    // free tail of the staging buffer.
+    boost::asio::mutable_buffers_1 prepare_staging(std::size_t n)
+    {
+        if (staging_begin_ + n > staging_.size())
+        {
+            std::memmove(&staging_[0], &staging_[0] + staging_begin_, staged());
+            staging_end_ -= staging_begin_;
+            staging_begin_ = 0;
+
+            if (n > staging_.size())
+                staging_.resize(n);
+        }
+
+        return boost::asio::buffer(&staging_[0] + staging_end_
+                                 , staging_.size() - staging_end_);
+    }
+
+    // Block until at least n bytes are staged.
+    void fill_staging(std::size_t n)
+    {
+        std::size_t const needed = staging_shortfall(n);
+
+        if (0 == needed)
+            return;
+
+        boost::asio::mutable_buffers_1 free = prepare_staging(n);
+
+        staging_end_ += read_at_least(socket_->native_handle()
+          , boost::asio::buffer_cast<char*>(free)
+          , boost::asio::buffer_size(free)
+          , needed
+          , last_syscalls_);
+    }
+
+    void consume_staging(void* dest, std::size_t n)
+    {
+        BOOST_ASSERT(n <= staged());
+        std::memcpy(dest, &staging_[0] + staging_begin_, n);
+        staging_begin_ += n;
+
+        if (staging_begin_ == staging_end_)
+            staging_begin_ = staging_end_ = 0;
+    }
+
+    // Decode the staged prelude. Returns the number of bytes of the size table
+    // that follow the prelude.
+    std::size_t read_prelude()
+    {
+        consume_staging(&prelude_, sizeof(prelude_));
+        to_wire_order(prelude_);
+
+        // The clear_to_send of a rendezvous message goes to its sender, which
+        // waits for it in zero_copy_oarchive::write().
+        if (0 != (prelude_.flags & zero_copy_prelude::clear_to_send))
+        {
+            reset();
+
+            BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+                boost::archive::archive_exception::input_stream_error
+              , "unexpected clear_to_send"));
+        }
+
+        channel_ = boost::uint32_t(
+            prelude_.flags >> zero_copy_prelude::channel_shift);
+
+        shared_slow_path_
+            = 0 != (prelude_.flags & zero_copy_prelude::slow_segment);
+
+        // Nothing is allocated for a message before its body and its size
+        // table have been checked against max_body_size().
+        if (prelude_.body_size > max_body_size_)
+            layout_error();
+
+        layout_left_ = max_body_size_;
+        body_left_ = prelude_.body_size;
+
+        claim_layout(prelude_.chunks, sizeof(boost::integer::ulittle64_t));
+
+        std::vector<boost::integer::ulittle64_t>& chunk_sizes
+            = arena_.chunk_sizes();
+
+        chunk_sizes.resize(std::size_t(prelude_.chunks));
+
+        std::size_t const inlined = (std::min)(std::size_t(prelude_.chunks)
+          , std::size_t(zero_copy_prelude::inline_chunks));
+        std::copy(prelude_.chunk_sizes, prelude_.chunk_sizes + inlined
+                , chunk_sizes.begin());
+
+        return (chunk_sizes.size() - inlined)
+             * sizeof(boost::integer::ulittle64_t);
+    }
+
+    void read_chunk_sizes()
+    {
+        std::vector<boost::integer::ulittle64_t>& chunk_sizes
+            = arena_.chunk_sizes();
+
+        std::size_t const inlined = (std::min)(chunk_sizes.size()
+          , std::size_t(zero_copy_prelude::inline_chunks));
+
+        if (chunk_sizes.size() > inlined)
+        {
+            consume_staging(&chunk_sizes[inlined]
+              , (chunk_sizes.size() - inlined)
+              * sizeof(boost::integer::ulittle64_t));
+            to_wire_order(&chunk_sizes[inlined], chunk_sizes.size() - inlined);
+        }
+    }
+
+    // Count the message, and give the owner a chance to prepare for the
+    // body of a rendezvous message.
+    void announce()
+    {
+        if (0 == (prelude_.flags & zero_copy_prelude::rendezvous))
+        {
+            ++eager_messages_;
+            return;
+        }
+
+        ++rendezvous_messages_;
+
+        if (rendezvous_handler_)
+            rendezvous_handler_(std::size_t(prelude_.body_size));
+    }
+
+    // Is the sender of the current message waiting for its clear_to_send?
+    bool awaiting_clear_to_send() const
+    {
+        return !cleared_to_send_
+            && 0 != (prelude_.flags & zero_copy_prelude::rendezvous);
+    }
+
+    // The parcel has been laid out; let the sender of a rendezvous message
+    // go ahead with the body. Returns false if it isn't waiting.
+    bool prepare_clear_to_send()
+    {
+        if (!awaiting_clear_to_send())
+            return false;
+
+        cts_ = clear_to_send_for(prelude_);
+        to_wire_order(cts_);
+
+        cleared_to_send_ = true;
+        return true;
+    }
+
+    // Synchronously; async_read_body() does it on the asynchronous paths.
+    void clear_to_send()
+    {
+        if (!prepare_clear_to_send())
+            return;
+
+        iovec v = { &cts_, sizeof(cts_) };
+        last_syscalls_ += gather_write(socket_->native_handle(), &v, 1);
+    }
+
+    // Take the striped ranges of the message out of the buffer list, into one
+    // iovec array per stripe connection. Returns false if there are none.
+    bool take_stripes()
+    {
+        std::size_t const ranges = stripe_range_count();
+
+        if (0 == ranges)
+            return false;
+
+        std::vector<boost::integer::ulittle64_t> const& chunk_sizes
+            = arena_.chunk_sizes();
+
+        if (2 + 2 * ranges > chunk_sizes.size())
+            layout_error();
+
+        std::size_t const first = chunk_sizes.size() - 2 - 2 * ranges;
+        std::size_t const stripe_size = chunk_sizes.at(first);
+        std::size_t const stripes = chunk_sizes.at(first + 1);
+
+        if (0 == stripe_size)
+            layout_error();
+
+        if (stripes > stripes_.size())
+        {
+            reset();
+
+            BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+                boost::archive::archive_exception::input_stream_error
+              , "message striped over more connections than were added"));
+        }
+
+        stripe_ranges_.resize(ranges);
+
+        for (std::size_t r = 0; r < ranges; ++r)
+        {
+            stripe_ranges_[r].offset = chunk_sizes.at(first + 2 + 2 * r);
+            stripe_ranges_[r].length = chunk_sizes.at(first + 3 + 2 * r);
+        }
+
+        std::vector<boost::asio::mutable_buffer>& message = arena_.message();
+
+        to_iovecs(message, iovecs_);
+
+        stripe_iovecs_.resize(stripes);
+        ::split_stripes(iovecs_, 0, stripe_ranges_, stripe_size
+                      , stripe_iovecs_);
+
+        message.clear();
+        for (std::size_t i = 0; i < iovecs_.size(); ++i)
+            message.push_back(boost::asio::buffer(iovecs_[i].iov_base
+                                                , iovecs_[i].iov_len));
+
+        return true;
+    }
+
+    std::size_t stripe_range_count() const
+    {
+        return std::size_t(
+            (prelude_.flags >> zero_copy_prelude::stripe_ranges_shift)
+          & zero_copy_prelude::stripe_ranges_mask);
+    }
+
+    // Block until the rest of the body has arrived; see take_stripes().
+    void read_body(bool striped)
+    {
+        // Bypass Asio here; it only passes 64 buffers per readv to the kernel.
+        to_iovecs(arena_.message(), iovecs_);
+
+        native_handle_type const fd = socket_->native_handle();
+        iovec* const iov = iovecs_.empty() ? 0 : &iovecs_[0];
+
+        if (striped)
+            last_syscalls_ += stripe_workers_.transfer(scatter_reader(), fd
+              , iov, iovecs_.size(), stripe_iovecs_);
+        else if (!iovecs_.empty())
+            last_syscalls_ += scatter_read(fd, iov, iovecs_.size());
+    }
+
+    // Outstanding asynchronous reads of a body.
+    template <typename Handler>
+    struct body_reads
+    {
+        Handler handler;
+        std::size_t pending;
+        boost::system::error_code error; ///< The first one.
+
+        body_reads(Handler const& h, std::size_t n)
+          : handler(h)
+          , pending(n)
+          , error()
+        {}
+
+        void done(boost::system::error_code const& e)
+        {
+            if (e && !error)
+                error = e;
+
+            if (0 == --pending)
+                handler(error);
+        }
+    };
+
+    // Read the rest of the body, and the stripes of take_stripes() over
+    // their connections, and call h with the first error once all of it has
+    // arrived. The clear_to_send of a rendezvous message is written first.
+    template <typename Handler>
+    void async_read_body(Handler const& h)
+    {
+        if (prepare_clear_to_send())
+        {
+            boost::asio::async_write(*socket_,
+                boost::asio::buffer(&cts_, sizeof(cts_)),
+                boost::bind(&basic_zero_copy_iarchive::handle_clear_to_send,
+                    this->shared_from_this(),
+                    boost::asio::placeholders::error, handler_type(h)));
+            return;
+        }
+
+        std::size_t reads = 1;
+        for (std::size_t s = 0; s < stripe_iovecs_.size(); ++s)
+            if (!stripe_iovecs_[s].empty())
+                ++reads;
+
+        boost::shared_ptr<body_reads<Handler> > r(
+            new body_reads<Handler>(h, reads));
+
+        boost::asio::async_read(*socket_, arena_.message(),
+            boost::bind(&body_reads<Handler>::done, r,
+                boost::asio::placeholders::error));
+
+        stripe_buffers_.resize(stripe_iovecs_.size());
+
+        for (std::size_t s = 0; s < stripe_iovecs_.size(); ++s)
+        {
+            std::vector<boost::asio::mutable_buffer>& buffers
+                = stripe_buffers_[s];
+            buffers.clear();
+
+            if (stripe_iovecs_[s].empty())
+                continue;
+
+            for (std::size_t i = 0; i < stripe_iovecs_[s].size(); ++i)
+                buffers.push_back(boost::asio::buffer(
+                    stripe_iovecs_[s][i].iov_base
+                  , stripe_iovecs_[s][i].iov_len));
+
+            boost::asio::async_read(*stripes_[s], buffers,
+                boost::bind(&body_reads<Handler>::done, r,
+                    boost::asio::placeholders::error));
+        }
+    }
+
+    void handle_clear_to_send(
+        boost::system::error_code const& e
+      , handler_type const& h
+        )
+    {
+        if (e)
+            h(e);
+        else
+            async_read_body(h);
+    }
+
+    // The slow segment follows the rest of the body. Its size is the end of
+    // the last slow field.
+    void add_slow_segment()
+    {
+        if (0 == slow_segment_size_)
+            return;
+
+        claim_body(slow_segment_size_);
+        claim_layout(slow_segment_size_, 1);
+
+        char* p = arena_.allocate(slow_segment_size_);
+        slow_segment_ = boost::asio::buffer(p, slow_segment_size_);
+        arena_.message().push_back(slow_segment_);
+        inline_run_ = false;
+    }
+
+    // The checksum follows the rest of the body. Remember the buffers of the
+    // whole body, before the parts of it that are already staged or come
+    // over stripe connections are taken out.
+    void add_checksum()
+    {
+        if (0 == (prelude_.flags & zero_copy_prelude::checksum))
+            return;
+
+        claim_body(sizeof(boost::integer::ulittle64_t));
+
+        char* p = arena_.allocate(sizeof(boost::integer::ulittle64_t));
+        arena_.message().push_back(
+            boost::asio::buffer(p, sizeof(boost::integer::ulittle64_t)));
+        inline_run_ = false;
+
+        checksum_buffers_ = arena_.message();
+    }
+
+    // Checksum the body once all of it has arrived, and compare.
+    bool checksum_matches() const
+    {
+        if (checksum_buffers_.empty())
+            return true;
+
+        boost::uint32_t crc = 0;
+
+        for (std::size_t i = 0; i + 1 < checksum_buffers_.size(); ++i)
+            crc = crc32c(crc
+              , boost::asio::buffer_cast<void const*>(checksum_buffers_[i])
+              , boost::asio::buffer_size(checksum_buffers_[i]));
+
+        boost::integer::ulittle64_t trailer;
+        std::memcpy(&trailer
+          , boost::asio::buffer_cast<void const*>(checksum_buffers_.back())
+          , sizeof(trailer));
+        to_wire_order(&trailer, 1);
+
+        return trailer == crc;
+    }
+
+    // The message has been read completely, so the connection stays usable.
+    void verify_checksum()
+    {
+        if (checksum_matches())
+            return;
+
+        ++checksum_failures_;
+        reset();
+
+        BOOST_THROW_EXCEPTION(boost::archive::archive_exception(
+            boost::archive::archive_exception::input_stream_error
+          , "checksum mismatch"));
+    }
+
+    // Skip the body of the current message. It is read into the staging
+    // buffer bit by bit, like the next message would be, and thrown away.
+    // Returns true if the message is striped: then the body is laid out over
+    // a scratch buffer in the arena instead, again and again, and has to be
+    // read like any other, as the stripes come over their own connections.
+    // The sender of a rendezvous message still has to be cleared to send,
+    // and the message reset, by the caller.
+    bool drop_message()
+    {
+        ++dropped_messages_;
+
+        std::size_t const body = std::size_t(prelude_.body_size);
+
+        if (0 == stripe_range_count())
+        {
+            discard_ = body;
+            discard_staged();
+            return false;
+        }
+
+        std::size_t const scratch
+            = (std::min)(body, std::size_t(drop_scratch_size));
+        char* p = arena_.allocate(scratch);
+
+        for (std::size_t left = body; 0 != left; )
+        {
+            std::size_t const n = (std::min)(left, scratch);
+            arena_.message().push_back(boost::asio::buffer(p, n));
+            left -= n;
+        }
+
+        take_stripes();
+        drain_staging();
+        return true;
+    }
+
+    // Throw away as much of the dropped body as is staged.
+    void discard_staged()
+    {
+        std::size_t const n = (std::min)(discard_, staged());
+
+        staging_begin_ += n;
+        discard_ -= n;
+
+        if (staging_begin_ == staging_end_)
+            staging_begin_ = staging_end_ = 0;
+    }
+
+    // Block until the dropped body has been read.
+    void skip_body()
+    {
+        for (discard_staged(); 0 != discard_; discard_staged())
+            fill_staging((std::min)(discard_, staging_.size()));
+    }
+
+    // Copy the staged part of the body into the front of the message, and
+    // drop the buffers that have been completely filled.
+    void drain_staging()
+    {
+        std::vector<boost::asio::mutable_buffer>& message = arena_.message();
+        std::vector<boost::asio::mutable_buffer>::iterator it
+            = message.begin();
+
+        while (it != message.end() && 0 != staged())
+        {
+            std::size_t const size = boost::asio::buffer_size(*it);
+            std::size_t const n = (std::min)(size, staged());
+
+            consume_staging(boost::asio::buffer_cast<void*>(*it), n);
+
+            if (n < size)
+            {
+                *it = *it + n;
+                break;
+            }
+
+            ++it;
+        }
+
+        message.erase(message.begin(), it);
+    }
+
+    void reset()
+    {
+        arena_.reset();
+        prelude_ = zero_copy_prelude();
+        current_chunk_ = 0;
+        copy_buffers_.clear();
+        current_copy_buffer_ = 0;
+        encoded_chunks_.clear();
+        current_encoded_chunk_ = 0;
+        adopted_chunks_.clear();
+        current_adopted_chunk_ = 0;
+        checksum_buffers_.clear();
+        slow_archive_.reset();
+        slow_streambuf_.reset();
+        slow_segment_size_ = 0;
+        slow_segment_ = boost::asio::mutable_buffer();
+        inline_run_ = false;
+        cleared_to_send_ = false;
+        stripe_ranges_.clear();
+
+        for (std::size_t s = 0; s < stripe_iovecs_.size(); ++s)
+            stripe_iovecs_[s].clear();
+    }
+};
+
+typedef basic_zero_copy_iarchive<boost::asio::ip::tcp::socket>
+    zero_copy_iarchive;
 
 #endif
 
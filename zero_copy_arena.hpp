@@ -0,0 +1,160 @@
+//  Copyright (c) 2012 Bryce Adelstein-Lelbach
+//
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#if !defined(Z1B0A3F62_58C4_4E0D_9C1E_7D2A4B6E9F10)
+#define Z1B0A3F62_58C4_4E0D_9C1E_7D2A4B6E9F10
+
+#include <boost/assert.hpp>
+#include <boost/cstdint.hpp>
+
+#include <vector>
+#include <algorithm>
+
+// NOTE: Not using the actual Boost.Endian code to avoid copying more stuff
+// over to this git repository.
+namespace boost { namespace integer { typedef boost::uint64_t ulittle64_t; }}
+
+// Per-connection bump allocator for the bookkeeping of one zero-copy message:
+// the buffer (iovec) list, the chunk size table and every byte that goes
+// through the slow path. Between messages the arena is reset, not freed, so
+// once it has grown to fit the traffic on a connection, serializing a message
+// doesn't touch the heap at all.
+template <typename Buffer>
+struct zero_copy_arena
+{
+    BOOST_STATIC_CONSTANT(std::size_t, default_block_size = 64 * 1024);
+
+  private:
+    std::vector<Buffer> message_;
+    std::vector<boost::integer::ulittle64_t> chunk_sizes_;
+
+    std::vector<std::vector<char> > blocks_;
+    std::size_t block_size_;
+    std::size_t current_block_;
+    std::size_t offset_; ///< First free byte in blocks_[current_block_].
+
+  public:
+    zero_copy_arena(std::size_t block_size = default_block_size)
+      : message_()
+      , chunk_sizes_()
+      , blocks_()
+      , block_size_(block_size)
+      , current_block_(0)
+      , offset_(0)
+    {}
+
+    std::vector<Buffer>& message() { return message_; }
+    std::vector<Buffer> const& message() const { return message_; }
+
+    std::vector<boost::integer::ulittle64_t>& chunk_sizes()
+    {
+        return chunk_sizes_;
+    }
+    std::vector<boost::integer::ulittle64_t> const& chunk_sizes() const
+    {
+        return chunk_sizes_;
+    }
+
+    // Returns n bytes of storage that stay valid until the next reset().
+    char* allocate(std::size_t n)
+    {
+        while (current_block_ < blocks_.size())
+        {
+            std::vector<char>& block = blocks_[current_block_];
+
+            if (offset_ + n <= block.size())
+            {
+                char* p = &block[0] + offset_;
+                offset_ += n;
+                return p;
+            }
+
+            ++current_block_;
+            offset_ = 0;
+        }
+
+        blocks_.push_back(std::vector<char>((std::max)(n, block_size_)));
+        current_block_ = blocks_.size() - 1;
+        offset_ = n;
+        return &blocks_.back()[0];
+    }
+
+    // Give back the last n bytes of the latest allocation, for when less of
+    // it was used than asked for.
+    void release(std::size_t n)
+    {
+        BOOST_ASSERT(n <= offset_);
+        offset_ -= n;
+    }
+
+    // Make room for a message of the given shape up front, so that building
+    // it neither grows the buffer list or the size table, nor needs more than
+    // one block for the allocations.
+    void reserve(std::size_t buffers, std::size_t chunks, std::size_t bytes)
+    {
+        message_.reserve(buffers);
+        chunk_sizes_.reserve(chunks);
+
+        if (0 == bytes)
+            return;
+
+        if (  current_block_ < blocks_.size()
+           && blocks_[current_block_].size() - offset_ >= bytes)
+            return;
+
+        blocks_.push_back(std::vector<char>((std::max)(bytes, block_size_)));
+        current_block_ = blocks_.size() - 1;
+        offset_ = 0;
+    }
+
+    // Forget the current message, but keep all the memory around. If the last
+    // message needed more than one block, the blocks are merged so that the
+    // next message of the same shape fits into one.
+    void reset()
+    {
+        message_.clear();
+        chunk_sizes_.clear();
+
+        if (blocks_.size() > 1)
+        {
+            std::size_t total = 0;
+            for (std::size_t i = 0; i < blocks_.size(); ++i)
+                total += blocks_[i].size();
+
+            blocks_.clear();
+            blocks_.push_back(std::vector<char>(total));
+        }
+
+        current_block_ = 0;
+        offset_ = 0;
+    }
+
+    void swap(zero_copy_arena& other)
+    {
+        // The buffers of the message point into the vectors' storage, which
+        // moves along with them.
+        message_.swap(other.message_);
+        chunk_sizes_.swap(other.chunk_sizes_);
+        blocks_.swap(other.blocks_);
+        std::swap(block_size_, other.block_size_);
+        std::swap(current_block_, other.current_block_);
+        std::swap(offset_, other.offset_);
+    }
+
+    // Number of bytes held by the arena, including the capacity of the buffer
+    // list and the chunk size table.
+    std::size_t reserved_bytes() const
+    {
+        std::size_t bytes = message_.capacity() * sizeof(Buffer)
+            + chunk_sizes_.capacity() * sizeof(boost::integer::ulittle64_t);
+
+        for (std::size_t i = 0; i < blocks_.size(); ++i)
+            bytes += blocks_[i].size();
+
+        return bytes;
+    }
+};
+
+#endif
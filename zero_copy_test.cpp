@@ -8,6 +8,11 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 
 #include "zero_copy_archive.hpp"
+#include "default_init_allocator.hpp"
+#include "buffer_pool.hpp"
+#include "gather_calibration.hpp"
+#include "homogeneity_handshake.hpp"
+#include "shm_transport.hpp"
 #include "high_resolution_timer.hpp"
 
 #include <boost/lexical_cast.hpp>
@@ -23,6 +28,7 @@
 
 #include <sched.h>
 #include <time.h>
+#include <unistd.h>
 
 using boost::program_options::variables_map;
 using boost::program_options::options_description;
@@ -32,6 +38,21 @@ using boost::program_options::command_line_parser;
 using boost::program_options::notify;
 
 using boost::asio::ip::tcp;
+using boost::asio::local::stream_protocol;
+
+// Received into without zeroing it first (--default-init).
+typedef std::vector<double, default_init_allocator<double> >
+    default_init_vector;
+
+// Received into storage recycled by buffer_pool::instance() (--pool).
+typedef std::vector<double, pool_allocator<double> > pool_vector;
+typedef std::vector<double
+                  , default_init_allocator<double, pool_allocator<double> >
+                   > default_init_pool_vector;
+
+// Kept in the shared heap of a shm connection, and handed off to the peer
+// instead of being sent (--shm-heap-size).
+typedef std::vector<double, shm_allocator<double> > shm_vector;
 
 #if defined(CHECK_DATA)
     std::vector<double> correct_data;
@@ -48,15 +69,109 @@ using boost::asio::ip::tcp;
     }
 #endif
 
+// Where the server listens: a TCP port on all interfaces, or for
+// --transport=unix and shm a socket file, which is removed first in case an
+// earlier run left it behind.
+template <typename Protocol>
+typename Protocol::endpoint listen_endpoint(variables_map& vm);
+
+template <>
+tcp::endpoint listen_endpoint<tcp>(variables_map& vm)
+{
+    return tcp::endpoint(tcp::v4(), boost::lexical_cast<boost::uint16_t>
+        (vm["port"].as<std::string>()));
+}
+
+template <>
+stream_protocol::endpoint listen_endpoint<stream_protocol>(variables_map& vm)
+{
+    std::string path = vm["socket-path"].as<std::string>();
+    ::unlink(path.c_str());
+    return stream_protocol::endpoint(path);
+}
+
+template <>
+shm_protocol::endpoint listen_endpoint<shm_protocol>(variables_map& vm)
+{
+    return listen_endpoint<stream_protocol>(vm);
+}
+
+// Where the client connects to.
+template <typename Protocol>
+typename Protocol::endpoint connect_endpoint(
+    boost::asio::io_service& io_service
+  , variables_map& vm
+    );
+
+template <>
+tcp::endpoint connect_endpoint<tcp>(
+    boost::asio::io_service& io_service
+  , variables_map& vm
+    )
+{
+    // Resolve the target's address.
+    tcp::resolver resolver(io_service);
+    tcp::resolver::query query(tcp::v4(), vm["host"].as<std::string>()
+                             , vm["port"].as<std::string>());
+    return resolver.resolve(query)->endpoint();
+}
+
+template <>
+stream_protocol::endpoint connect_endpoint<stream_protocol>(
+    boost::asio::io_service&
+  , variables_map& vm
+    )
+{
+    return stream_protocol::endpoint(vm["socket-path"].as<std::string>());
+}
+
+template <>
+shm_protocol::endpoint connect_endpoint<shm_protocol>(
+    boost::asio::io_service& io_service
+  , variables_map& vm
+    )
+{
+    return connect_endpoint<stream_protocol>(io_service, vm);
+}
+
+// The vector that is generated and sent first: over shm, a shm_vector starts
+// out in the shared heap.
+template <typename Vector, typename Socket>
+Vector make_vector(Socket&)
+{
+    return Vector();
+}
+
+template <>
+shm_vector make_vector<shm_vector, shm_stream>(shm_stream& s)
+{
+    return shm_vector(shm_allocator<double>(s.heap()));
+}
+
+// The shared heap of the connections the client opens (--shm-heap-size).
+template <typename Socket>
+void heap_size(Socket&, boost::uint64_t) {}
+
+inline void heap_size(shm_stream& s, boost::uint64_t n)
+{
+    s.heap_size(std::size_t(n));
+}
+
 // Receive, then send.
+template <typename Stream, typename Vector>
 void receive(
-    zero_copy_oarchive& sender
-  , zero_copy_iarchive& receiver
-  , std::vector<double>& data
+    basic_zero_copy_oarchive<Stream>& sender
+  , basic_zero_copy_iarchive<Stream>& receiver
+  , Vector& data
   , boost::uint64_t iteration
     )
 {
-    receiver.read(data);
+    // Receive into a fresh vector, like a receiver that hands the parcel on
+    // would, so that every read sizes (and allocates) the vector. It becomes
+    // the data that is sent back, and the old one is dropped.
+    Vector received;
+    receiver.read(received);
+    data.swap(received);
 
 #if defined(CHECK_DATA)
     if (data.size() != correct_data.size())
@@ -81,10 +196,11 @@ void receive(
 #endif
 }
 
+template <typename Stream, typename Vector>
 void send(
-    zero_copy_oarchive& sender
-  , zero_copy_iarchive& receiver
-  , std::vector<double>& data
+    basic_zero_copy_oarchive<Stream>& sender
+  , basic_zero_copy_iarchive<Stream>& receiver
+  , Vector& data
   , boost::uint64_t iteration
     )
 {
@@ -113,47 +229,83 @@ void send(
 }
 
 // Generate a vector of doubles filled with random data.
+template <typename Vector>
 void generate_data(
-    std::vector<double>& data
+    Vector& data
   , boost::uint64_t vector_size
   , boost::uint64_t seed
     )
 {
     boost::random::mt19937_64 prng(seed);
     boost::random::uniform_01<> dst;
-    std::back_insert_iterator<std::vector<double> > it(data);
+    std::back_insert_iterator<Vector> it(data);
     std::generate_n(it, vector_size, boost::bind(dst, boost::ref(prng))); 
 }
 
-std::string server_main(variables_map& vm)
+template <typename Protocol, typename Vector>
+std::string run_server(variables_map& vm)
 {
-    std::string host = vm["host"].as<std::string>();
-    boost::uint16_t port = boost::lexical_cast<boost::uint16_t>
-        (vm["port"].as<std::string>());
+    typedef typename Protocol::socket socket_type;
+    typedef typename Protocol::acceptor acceptor_type;
+
+    std::string transport = vm["transport"].as<std::string>();
  
     boost::uint64_t vector_size = vm["vector-size"].as<boost::uint64_t>();
     boost::uint64_t iterations = vm["iterations"].as<boost::uint64_t>();
     boost::uint64_t seed = vm["seed"].as<boost::uint64_t>();
+    boost::uint64_t gather_threshold
+        = vm["gather-threshold"].as<boost::uint64_t>();
+    boost::uint64_t rendezvous_threshold
+        = vm["rendezvous-threshold"].as<boost::uint64_t>();
+    boost::uint64_t stripes = vm["stripes"].as<boost::uint64_t>();
+    boost::uint64_t stripe_size = vm["stripe-size"].as<boost::uint64_t>();
+    std::string codec = vm["codec"].as<std::string>();
+    double compression_ratio = vm["compression-ratio"].as<double>();
+    bool checksum = vm.count("checksum");
  
     boost::asio::io_service io_service;
 
-    tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), port));
-    acceptor.set_option(tcp::acceptor::reuse_address(true));
-    acceptor.set_option(tcp::acceptor::linger(true, 0));
+    acceptor_type acceptor(io_service, listen_endpoint<Protocol>(vm));
+    acceptor.set_option(typename acceptor_type::reuse_address(true));
+    acceptor.set_option(typename acceptor_type::linger(true, 0));
+
+    socket_type s(io_service);
+    basic_zero_copy_oarchive<socket_type> sender(s);
+    basic_zero_copy_iarchive<socket_type> receiver(s);
 
-    tcp::socket s(io_service);
-    zero_copy_oarchive sender(s);
-    zero_copy_iarchive receiver(s);
+    sender.gather_threshold(gather_threshold);
+    receiver.gather_threshold(gather_threshold);
+    sender.rendezvous_threshold(rendezvous_threshold);
+    sender.stripe_size(stripe_size);
+    sender.codec(chunk_codecs::instance().find(codec));
+    sender.compression_ratio(compression_ratio);
+    sender.checksum(checksum);
+    sender.presizing(vm.count("presize"));
 
     // Start accepting connections.
     acceptor.accept(s);
 
-    // Generate a vector of doubles filled with random data.
-    std::vector<double> data;
+    // Find out once whether bitwise serialization is safe on this connection.
+    peer_layout const layout = negotiate_peer_layout(s);
+    sender.peer(layout);
+    receiver.peer(layout);
+    bool const homogeneity = sender.homogeneity();
 
-#if defined(CHECK_DATA)
-    generate_data(correct_data, vector_size, seed);
-#endif
+    // Accept the connections that large vectors are striped over.
+    std::vector<boost::shared_ptr<socket_type> > stripe_sockets;
+    for (std::size_t i = 0; i < stripes; ++i)
+    {
+        stripe_sockets.push_back(
+            boost::shared_ptr<socket_type>(new socket_type(io_service)));
+        acceptor.accept(*stripe_sockets.back());
+        sender.add_stripe(*stripe_sockets.back());
+        receiver.add_stripe(*stripe_sockets.back());
+    }
+
+    // Generate a vector of doubles filled with random data. The server sends
+    // first.
+    Vector data = make_vector<Vector>(s);
+    generate_data(data, vector_size, seed);
 
     // Start timing.
     high_resolution_timer clock;
@@ -168,44 +320,102 @@ std::string server_main(variables_map& vm)
 
     double elapsed = clock.elapsed();
 
+    // Shared by both ends with --both.
+    buffer_pool_stats const pool = buffer_pool::instance().stats();
+
     return boost::str(boost::format(
-        "server seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s]"
-        ) % seed % vector_size % iterations % elapsed);
+        "server seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s] "
+        "arena=%5%[bytes] syscalls=%6%[per message] homogeneity=%7% "
+        "rendezvous=%8%[messages] default-init=%9% stripes=%10% "
+        "codec=%11% encoded=%12%[bytes] compressed=%13%[bytes] "
+        "checksum=%14% transport=%15% pool=%16% pool-hits=%17% "
+        "pool-misses=%18% handed-off=%19%[bytes] throughput=%20%[MB/s]"
+        ) % seed % vector_size % iterations % elapsed
+          % (sender.arena_bytes() + receiver.arena_bytes())
+          % (double(sender.total_syscalls() + receiver.total_syscalls())
+              / iterations)
+          % homogeneity
+          % (sender.rendezvous_messages() + receiver.rendezvous_messages())
+          % vm.count("default-init")
+          % stripes
+          % codec
+          % sender.codec_bytes_in()
+          % sender.codec_bytes_out()
+          % checksum
+          % transport
+          % vm.count("pool")
+          % pool.hits
+          % pool.misses
+          % sender.handed_off_bytes()
+          % (double(iterations * vector_size * sizeof(double))
+              / elapsed / 1e6));
 }
 
-std::string client_main(variables_map& vm)
+template <typename Protocol, typename Vector>
+std::string run_client(variables_map& vm)
 {
-    std::string host = vm["host"].as<std::string>();
-    std::string port = vm["port"].as<std::string>();
+    typedef typename Protocol::socket socket_type;
+
+    std::string transport = vm["transport"].as<std::string>();
  
     boost::uint64_t vector_size = vm["vector-size"].as<boost::uint64_t>();
     boost::uint64_t iterations = vm["iterations"].as<boost::uint64_t>();
     boost::uint64_t seed = vm["seed"].as<boost::uint64_t>();
+    boost::uint64_t gather_threshold
+        = vm["gather-threshold"].as<boost::uint64_t>();
+    boost::uint64_t rendezvous_threshold
+        = vm["rendezvous-threshold"].as<boost::uint64_t>();
+    boost::uint64_t stripes = vm["stripes"].as<boost::uint64_t>();
+    boost::uint64_t stripe_size = vm["stripe-size"].as<boost::uint64_t>();
+    std::string codec = vm["codec"].as<std::string>();
+    double compression_ratio = vm["compression-ratio"].as<double>();
+    bool checksum = vm.count("checksum");
 
     boost::asio::io_service io_service;
 
-    // Resolve the target's address.
-    tcp::resolver resolver(io_service);
-    tcp::resolver::query query(tcp::v4(), host, port);
-    tcp::resolver::iterator iterator = resolver.resolve(query);
+    typename Protocol::endpoint endpoint
+        = connect_endpoint<Protocol>(io_service, vm);
+
+    socket_type s(io_service);
+    basic_zero_copy_oarchive<socket_type> sender(s);
+    basic_zero_copy_iarchive<socket_type> receiver(s);
 
-    tcp::socket s(io_service);
-    zero_copy_oarchive sender(s);
-    zero_copy_iarchive receiver(s);
+    sender.gather_threshold(gather_threshold);
+    receiver.gather_threshold(gather_threshold);
+    sender.rendezvous_threshold(rendezvous_threshold);
+    sender.stripe_size(stripe_size);
+    sender.codec(chunk_codecs::instance().find(codec));
+    sender.compression_ratio(compression_ratio);
+    sender.checksum(checksum);
+    sender.presizing(vm.count("presize"));
 
     // Connect to the target.
-    boost::asio::connect(s, iterator);
-    s.set_option(tcp::socket::reuse_address(true));
-    s.set_option(tcp::socket::linger(true, 0));
+    heap_size(s, vm["shm-heap-size"].as<boost::uint64_t>());
+    s.connect(endpoint);
+    s.set_option(typename socket_type::reuse_address(true));
+    s.set_option(typename socket_type::linger(true, 0));
+
+    // Find out once whether bitwise serialization is safe on this connection.
+    peer_layout const layout = negotiate_peer_layout(s);
+    sender.peer(layout);
+    receiver.peer(layout);
+    bool const homogeneity = sender.homogeneity();
+
+    // Open the connections that large vectors are striped over.
+    std::vector<boost::shared_ptr<socket_type> > stripe_sockets;
+    for (std::size_t i = 0; i < stripes; ++i)
+    {
+        stripe_sockets.push_back(
+            boost::shared_ptr<socket_type>(new socket_type(io_service)));
+        stripe_sockets.back()->connect(endpoint);
+        sender.add_stripe(*stripe_sockets.back());
+        receiver.add_stripe(*stripe_sockets.back());
+    }
 
     // Generate a vector of doubles filled with random data.
-    std::vector<double> data;
+    Vector data = make_vector<Vector>(s);
     generate_data(data, vector_size, seed);
 
-#if defined(CHECK_DATA)
-    generate_data(correct_data, vector_size, seed);
-#endif
-
     // Start timing.
     high_resolution_timer clock;
 
@@ -219,9 +429,93 @@ std::string client_main(variables_map& vm)
 
     double elapsed = clock.elapsed();
 
+    // Shared by both ends with --both.
+    buffer_pool_stats const pool = buffer_pool::instance().stats();
+
     return boost::str(boost::format(
-        "server seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s]"
-        ) % seed % vector_size % iterations % elapsed);
+        "client seed=%1% vector-size=%2%[double] iterations=%3% walltime=%4%[s] "
+        "arena=%5%[bytes] syscalls=%6%[per message] homogeneity=%7% "
+        "rendezvous=%8%[messages] default-init=%9% stripes=%10% "
+        "codec=%11% encoded=%12%[bytes] compressed=%13%[bytes] "
+        "checksum=%14% transport=%15% pool=%16% pool-hits=%17% "
+        "pool-misses=%18% handed-off=%19%[bytes] throughput=%20%[MB/s]"
+        ) % seed % vector_size % iterations % elapsed
+          % (sender.arena_bytes() + receiver.arena_bytes())
+          % (double(sender.total_syscalls() + receiver.total_syscalls())
+              / iterations)
+          % homogeneity
+          % (sender.rendezvous_messages() + receiver.rendezvous_messages())
+          % vm.count("default-init")
+          % stripes
+          % codec
+          % sender.codec_bytes_in()
+          % sender.codec_bytes_out()
+          % checksum
+          % transport
+          % vm.count("pool")
+          % pool.hits
+          % pool.misses
+          % sender.handed_off_bytes()
+          % (double(iterations * vector_size * sizeof(double))
+              / elapsed / 1e6));
+}
+
+template <typename Protocol>
+std::string run_server(variables_map& vm)
+{
+    if (0 != vm["shm-heap-size"].as<boost::uint64_t>())
+        return run_server<Protocol, shm_vector>(vm);
+
+    if (vm.count("pool"))
+    {
+        if (vm.count("default-init"))
+            return run_server<Protocol, default_init_pool_vector>(vm);
+        return run_server<Protocol, pool_vector>(vm);
+    }
+
+    if (vm.count("default-init"))
+        return run_server<Protocol, default_init_vector>(vm);
+    return run_server<Protocol, std::vector<double> >(vm);
+}
+
+template <typename Protocol>
+std::string run_client(variables_map& vm)
+{
+    if (0 != vm["shm-heap-size"].as<boost::uint64_t>())
+        return run_client<Protocol, shm_vector>(vm);
+
+    if (vm.count("pool"))
+    {
+        if (vm.count("default-init"))
+            return run_client<Protocol, default_init_pool_vector>(vm);
+        return run_client<Protocol, pool_vector>(vm);
+    }
+
+    if (vm.count("default-init"))
+        return run_client<Protocol, default_init_vector>(vm);
+    return run_client<Protocol, std::vector<double> >(vm);
+}
+
+std::string server_main(variables_map& vm)
+{
+    std::string const transport = vm["transport"].as<std::string>();
+
+    if ("unix" == transport)
+        return run_server<stream_protocol>(vm);
+    if ("shm" == transport)
+        return run_server<shm_protocol>(vm);
+    return run_server<tcp>(vm);
+}
+
+std::string client_main(variables_map& vm)
+{
+    std::string const transport = vm["transport"].as<std::string>();
+
+    if ("unix" == transport)
+        return run_client<stream_protocol>(vm);
+    if ("shm" == transport)
+        return run_client<shm_protocol>(vm);
+    return run_client<tcp>(vm);
 }
 
 int main(int argc, char** argv)
@@ -250,6 +544,15 @@ int main(int argc, char** argv)
         , value<std::string>()->default_value("9000")
         , "TCP port to connect to")
 
+        ( "transport"
+        , value<std::string>()->default_value("tcp")
+        , "connection to send over: tcp, unix (a UNIX domain socket) or shm "
+          "(shared memory)")
+
+        ( "socket-path"
+        , value<std::string>()->default_value("/tmp/zero_copy_test.socket")
+        , "socket file of --transport=unix and shm")
+
         ( "vector-size", value<boost::uint64_t>()->default_value(128),
           "number of elements (doubles) to send/receive")
 
@@ -259,6 +562,61 @@ int main(int argc, char** argv)
         ( "seed"
         , value<boost::uint64_t>()->default_value(1337)
         , "seed for the pseudo random number generator")
+
+        ( "gather-threshold"
+        , value<boost::uint64_t>()->default_value(
+            zero_copy_oarchive::default_gather_threshold)
+        , "largest field (in bytes) that is copied instead of being sent as "
+          "its own buffer")
+
+        ( "rendezvous-threshold"
+        , value<boost::uint64_t>()->default_value(
+            zero_copy_oarchive::default_rendezvous_threshold)
+        , "largest message body (in bytes) that is sent without waiting for "
+          "the receiver")
+
+        ( "stripes"
+        , value<boost::uint64_t>()->default_value(0)
+        , "number of additional connections that large vectors are striped "
+          "over")
+
+        ( "stripe-size"
+        , value<boost::uint64_t>()->default_value(
+            zero_copy_oarchive::default_stripe_size)
+        , "bytes per stripe")
+
+        ( "codec"
+        , value<std::string>()->default_value("none")
+        , "codec for large vectors: none, copy or shuffle-lz")
+
+        ( "compression-ratio"
+        , value<double>()->default_value(0.9)
+        , "largest compressed-to-original size ratio of a sample at which a "
+          "vector is still encoded")
+
+        ( "checksum"
+        , "send a CRC32C of every message body, and check it on receipt")
+
+        ( "presize"
+        , "size every message with an extra pass before serializing it, and "
+          "reserve the buffers it needs up front")
+
+        ( "default-init"
+        , "receive into vectors whose elements aren't zeroed before the data "
+          "arrives")
+
+        ( "pool"
+        , "receive into vectors whose storage is recycled by a buffer pool, "
+          "and report its hits and misses")
+
+        ( "shm-heap-size"
+        , value<boost::uint64_t>()->default_value(0)
+        , "bytes of shared memory that the vectors of --transport=shm are kept "
+          "in and handed off through instead of being sent; 0 sends them")
+
+        ( "calibrate-gather"
+        , "measure the copy-vs-gather crossover on this host and use it as "
+          "the gather threshold")
     ;
 
     store(command_line_parser(argc, argv).options(cmdline).run(), vm);
@@ -288,6 +646,40 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    std::string const transport = vm["transport"].as<std::string>();
+
+    if ("tcp" != transport && "unix" != transport && "shm" != transport)
+    {
+        std::cout << "ERROR: unknown transport '" << transport << "'\n"
+                  << cmdline;
+        return 1;
+    }
+
+    std::string const codec = vm["codec"].as<std::string>();
+
+    if ("none" != codec && !chunk_codecs::instance().find(codec))
+    {
+        std::cout << "ERROR: unknown codec '" << codec << "'\n"
+                  << cmdline;
+        return 1;
+    }
+
+    if (vm.count("calibrate-gather"))
+    {
+        boost::uint64_t threshold = calibrate_gather_threshold();
+        vm.at("gather-threshold").value() = threshold;
+
+        std::cout << "calibrated gather-threshold=" << threshold
+                  << "[bytes]\n";
+    }
+
+#if defined(CHECK_DATA)
+    // Made once, before either end starts, as both ends of --both check
+    // against it.
+    generate_data(correct_data, vm["vector-size"].as<boost::uint64_t>()
+                , vm["seed"].as<boost::uint64_t>());
+#endif
+
     if      (vm.count("server"))
         std::cout << server_main(vm) << "\n";
     else if (vm.count("client"))